@@ -1,8 +1,58 @@
+#include	<linux/sort.h>
 #include	<linux/mutex.h>
+#include	<linux/percpu.h>
 #include	<linux/string.h>
+#include	<linux/spinlock.h>
 #include	<linux/buffer_head.h>
 #include	"pfs.h"
 
+static void
+pfs_update_count(struct super_block *sb, int type, int64_t n)
+{
+	int64_t	*cntp;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	if(type){ 
+                cntp = &sbi->s_spb->s_bsize;
+                n = le64_to_cpu(sbi->s_spb->s_bsize) + n * PFS_STRS_PER_BLOCK;
+        }else{
+                cntp = &sbi->s_spb->s_iused;
+                n = le64_to_cpu(sbi->s_spb->s_iused) + n;
+        }
+        *cntp = cpu_to_le64(n); 
+	sbi->s_spb->s_utime = cpu_to_le64(CURRENT_TIME_SEC.tv_sec);
+	mark_buffer_dirty(sbi->s_sbh);
+}
+
+static int
+pfs_cmp_block(const void *a, const void *b)
+{
+	int64_t	x = le64_to_cpu(*(const int64_t *)a);
+	int64_t	y = le64_to_cpu(*(const int64_t *)b);
+
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/*
+ * largest index in 1..cnt-1 whose block is >= goal, 0 if there is none
+ */
+static int
+pfs_search_block(int64_t *freep, int64_t cnt, int64_t goal)
+{
+	int	mid, ret = 0;
+	int	lo = 1, hi = cnt - 1;
+
+	while(lo <= hi){
+		mid = (lo + hi) / 2;
+		if(le64_to_cpu(freep[mid]) >= goal){
+			ret = mid;
+			lo = mid + 1;
+		}else
+			hi = mid - 1;
+	}
+	return ret;
+}
+
 /*
  * both block and inode
  */
@@ -24,12 +74,17 @@ pfs_alloc0(struct super_block *sb, int type, int64_t *cntp, int64_t *headp,
 		isize = le64_to_cpu(sbi->s_spb->s_isize);
 		if(isize > le64_to_cpu(sbi->s_spb->s_ilimit)) 
 			return 0;
-		if(!(dno = pfs_alloc(sb, PFS_ALLOC_BLOCK)))
+		mutex_lock(&sbi->s_block);
+		if(!(dno = pfs_alloc(sb, PFS_ALLOC_BLOCK))){
+			mutex_unlock(&sbi->s_block);
 			return 0;
+		}
 		if(pfs_clear_block(sb, dno, PFS_SECTORSIZ)){
 			pfs_free(sb, dno, PFS_ALLOC_BLOCK);
+			mutex_unlock(&sbi->s_block);
 			return 0;
 		}
+		mutex_unlock(&sbi->s_block);
 		cnt = PFS_INDS_PER_BLOCK;
 		isize += PFS_INDS_PER_BLOCK;
 		sbi->s_spb->s_isize = cpu_to_le64(isize);
@@ -49,31 +104,27 @@ pfs_alloc0(struct super_block *sb, int type, int64_t *cntp, int64_t *headp,
 		*freep = type ? (int64_t *)bh->b_data : (int64_t *)((struct pfs_inode *)bh->b_data + tm % PFS_INDS_PER_BLOCK);
 		for(cnt = 0; cnt < (type ? PFS_INBLOCKS : PFS_ININODES) && (*freep)[cnt]; cnt++) 
 			;
+		if(type && cnt > 2){ 
+			sort(*freep + 1, cnt - 1, sizeof(int64_t), pfs_cmp_block, NULL);
+			mark_buffer_dirty(bh);
+		}
 		break;
 	default:
 		dno = le64_to_cpu((*freep)[--cnt]);
 		break;
 	}
 	*cntp = cpu_to_le64(cnt);
-	if(type){ 
-                cntp = &sbi->s_spb->s_bsize;
-                cnt = le64_to_cpu(sbi->s_spb->s_bsize) + PFS_STRS_PER_BLOCK;
-        }else{
-                cntp = &sbi->s_spb->s_iused;
-                cnt = le64_to_cpu(sbi->s_spb->s_iused) + 1;
-        }
-        *cntp = cpu_to_le64(cnt); 
-	sbi->s_spb->s_utime = cpu_to_le64(CURRENT_TIME_SEC.tv_sec);
-	mark_buffer_dirty(sbi->s_sbh);
+	pfs_update_count(sb, type, 1);
 	return dno;
 }
 
+static struct buffer_head *pfs_get_zero(struct super_block *sb, int64_t dno);
+
 static int
 pfs_free0(struct super_block *sb, int64_t dno, int type, int64_t *cntp, int64_t *headp, 
 	struct buffer_head **bhp, int64_t **freep)
 {
 	int32_t	cnt = le64_to_cpu(*cntp);
-	struct pfs_sb_info *sbi = PFS_SB(sb);
 	
 	if(cnt == 0){ 
 		if(pfs_clear_block(sb, dno, type ? PFS_BLOCKSIZ : PFS_SECTORSIZ))
@@ -82,7 +133,7 @@ pfs_free0(struct super_block *sb, int64_t dno, int type, int64_t *cntp, int64_t
 	if(cnt == (type ? PFS_INBLOCKS : PFS_ININODES)){
 		struct buffer_head *bh;
 
-		if(!(bh = sb_bread(sb, dno / PFS_INDS_PER_BLOCK)))
+		if(!(bh = type ? pfs_get_zero(sb, dno) : sb_bread(sb, dno / PFS_INDS_PER_BLOCK)))
 			return -1;
 		cnt = 1;
 		brelse(*bhp);	
@@ -90,29 +141,47 @@ pfs_free0(struct super_block *sb, int64_t dno, int type, int64_t *cntp, int64_t
 		*freep = type ? (int64_t *)bh->b_data : (int64_t *)((struct pfs_inode *)bh->b_data + dno % PFS_INDS_PER_BLOCK);
 		(*freep)[0] = *headp; 
 		*headp = cpu_to_le64(dno);
+	}else if(type && cnt){ 
+		int	i = pfs_search_block(*freep, cnt, dno) + 1;
+
+		memmove(*freep + i + 1, *freep + i, (cnt - i) * sizeof(int64_t));
+		(*freep)[i] = cpu_to_le64(dno);
+		cnt++;
 	}else
 		(*freep)[cnt++] = cpu_to_le64(dno);
 	*cntp = cpu_to_le64(cnt);
-	if(type){ 
-		cntp = &sbi->s_spb->s_bsize;
-		cnt = le64_to_cpu(sbi->s_spb->s_bsize) - PFS_STRS_PER_BLOCK;
-	}else{
-		cntp = &sbi->s_spb->s_iused;
-		cnt = le64_to_cpu(sbi->s_spb->s_iused) - 1;
-	}	
-	*cntp = cpu_to_le64(cnt); 
-	sbi->s_spb->s_utime = cpu_to_le64(CURRENT_TIME_SEC.tv_sec);
+	pfs_update_count(sb, type, -1);
         mark_buffer_dirty(*bhp);
-        mark_buffer_dirty(sbi->s_sbh);
 	return 0;
 }
 
+/*
+ * a zeroed buffer for the whole block dno, what is on disk is not read
+ */
+static struct buffer_head *
+pfs_get_zero(struct super_block *sb, int64_t dno)
+{
+	struct buffer_head *bh;
+
+	if(!(bh = sb_getblk(sb, dno / PFS_STRS_PER_BLOCK)))
+		return NULL;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, PFS_BLOCKSIZ);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	return bh;
+}
+
 int
 pfs_clear_block(struct super_block *sb, int64_t dno, int size)
 {
 	struct buffer_head *bh;
 
-	if(!(bh = sb_bread(sb, dno / PFS_INDS_PER_BLOCK)))
+	if(size == PFS_BLOCKSIZ)
+		bh = pfs_get_zero(sb, dno);
+	else
+		bh = sb_bread(sb, dno / PFS_INDS_PER_BLOCK);
+	if(!bh)
 		return -1;
 	memset((struct pfs_inode *)bh->b_data + dno % PFS_INDS_PER_BLOCK, 0, size);
         mark_buffer_dirty(bh);
@@ -134,6 +203,9 @@ pfs_alloc_zero(struct super_block *sb)
 	return dno;
 }
 
+/*
+ * the caller holds s_ilock for inodes and s_block for blocks
+ */
 int64_t
 pfs_alloc(struct super_block *sb, int type)
 {
@@ -153,3 +225,286 @@ pfs_free(struct super_block *sb, int64_t dno, int type)
 	return pfs_free0(sb, dno, type, type ? &spb->s_bcnt : &spb->s_icnt, type ? &spb->s_bhead : &spb->s_ihead, 
 		type ? &sbi->s_bbh : &sbi->s_ibh, type ? &sbi->s_bfree : &sbi->s_ifree);
 }
+
+/*
+ * slots 1..s_bcnt-1 of the current block free-list array are kept sorted in
+ * descending order: the top of the stack is the lowest free block, and the
+ * array doubles as an in-memory index to look goals up in. it is sorted
+ * when it is loaded and kept sorted by pfs_free0()
+ */
+void
+pfs_sort_blocklist(struct super_block *sb)
+{
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+	int64_t	cnt = le64_to_cpu(sbi->s_spb->s_bcnt);
+
+	mutex_lock(&sbi->s_block);
+	if(cnt > 2){
+		sort(sbi->s_bfree + 1, cnt - 1, sizeof(int64_t), pfs_cmp_block, NULL);
+		mark_buffer_dirty(sbi->s_bbh);
+	}
+	mutex_unlock(&sbi->s_block);
+}
+
+/*
+ * hand out up to count blocks in one pass under s_block. with a goal the
+ * blocks start at the lowest free block >= goal and go up from there, so
+ * they are physically adjacent whenever the free space is. the rest are
+ * taken straight off the top of the current free-list array, pfs_alloc()
+ * is only used when the array runs out and the next one has to be read.
+ * returns the number of blocks stored in dnos, 0 if the device is full
+ */
+int
+pfs_alloc_blocks(struct super_block *sb, int64_t goal, int count, int64_t *dnos)
+{
+	int	n, m, p;
+	int64_t	cnt;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+	struct pfs_super_block *spb = sbi->s_spb;
+
+	n = 0;
+	mutex_lock(&sbi->s_block);
+	cnt = le64_to_cpu(spb->s_bcnt);
+	if(goal && cnt > 1 && (p = pfs_search_block(sbi->s_bfree, cnt, goal))){
+		for(m = p; n < count && m > 0; m--)
+			dnos[n++] = le64_to_cpu(sbi->s_bfree[m]);
+		memmove(sbi->s_bfree + m + 1, sbi->s_bfree + p + 1, (cnt - p - 1) * sizeof(int64_t));
+		spb->s_bcnt = cpu_to_le64(cnt - n);
+		mark_buffer_dirty(sbi->s_bbh);
+		pfs_update_count(sb, PFS_ALLOC_BLOCK, n);
+	}
+	while(n < count){
+		cnt = le64_to_cpu(spb->s_bcnt);
+		for(m = n; n < count && cnt > 1; n++) 
+			dnos[n] = le64_to_cpu(sbi->s_bfree[--cnt]);
+		if(n > m){
+			spb->s_bcnt = cpu_to_le64(cnt);
+			pfs_update_count(sb, PFS_ALLOC_BLOCK, n - m);
+		}
+		if(n < count && !(dnos[n++] = pfs_alloc(sb, PFS_ALLOC_BLOCK))){
+			n--;
+			break;
+		}
+	}
+	mutex_unlock(&sbi->s_block);
+	return n;
+}
+
+static int64_t
+pfs_steal_block(struct super_block *sb)
+{
+	int	cpu;
+	int64_t	dno = 0;
+	struct pfs_bcache *c;
+
+	for_each_possible_cpu(cpu){
+		c = per_cpu_ptr(PFS_SB(sb)->s_bcache, cpu);
+		spin_lock(&c->c_lock);
+		if(c->c_cnt)
+			dno = c->c_blk[--c->c_cnt];
+		spin_unlock(&c->c_lock);
+		if(dno)
+			break;
+	}
+	return dno;
+}
+
+/*
+ * the common path only touches the cache of the current cpu, s_block is
+ * taken once per PFS_BCACHEBATCH blocks to refill or drain it. the goal is
+ * taken from the cache when it is there, and refills start at the goal
+ */
+int64_t
+pfs_new_block(struct super_block *sb, int64_t goal)
+{
+	int	i, n;
+	int64_t	dno, blk[PFS_BCACHEBATCH];
+	struct pfs_bcache *c;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	c = per_cpu_ptr(sbi->s_bcache, raw_smp_processor_id());
+	spin_lock(&c->c_lock);
+	if(c->c_cnt){
+		for(i = c->c_cnt - 1; goal && i >= 0 && c->c_blk[i] != goal; i--)
+			;
+		if(i < 0)
+			i = c->c_cnt - 1;
+		dno = c->c_blk[i];
+		memmove(c->c_blk + i, c->c_blk + i + 1, (--c->c_cnt - i) * sizeof(int64_t));
+		spin_unlock(&c->c_lock);
+		return dno;
+	}
+	spin_unlock(&c->c_lock);
+	if(!(n = pfs_alloc_blocks(sb, goal, PFS_BCACHEBATCH, blk)))
+		return pfs_steal_block(sb);
+	c = per_cpu_ptr(sbi->s_bcache, raw_smp_processor_id());
+	spin_lock(&c->c_lock);
+	for(i = n - 1; i > 0 && c->c_cnt < PFS_BCACHESIZ; i--) 
+		c->c_blk[c->c_cnt++] = blk[i];
+	spin_unlock(&c->c_lock);
+	if(i > 0){ 
+		mutex_lock(&sbi->s_block);
+		while(i > 0)
+			pfs_free(sb, blk[i--], PFS_ALLOC_BLOCK);
+		mutex_unlock(&sbi->s_block);
+	}
+	return blk[0];
+}
+
+int
+pfs_free_block(struct super_block *sb, int64_t dno)
+{
+	int	i, n;
+	int	err = 0;
+	int64_t	blk[PFS_BCACHEBATCH];
+	struct pfs_bcache *c;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	c = per_cpu_ptr(sbi->s_bcache, raw_smp_processor_id());
+	spin_lock(&c->c_lock);
+	if(c->c_cnt < PFS_BCACHESIZ){
+		c->c_blk[c->c_cnt++] = dno;
+		spin_unlock(&c->c_lock);
+		return 0;
+	}
+	for(blk[0] = dno, n = 1; n < PFS_BCACHEBATCH; n++)
+		blk[n] = c->c_blk[--c->c_cnt];
+	spin_unlock(&c->c_lock);
+	mutex_lock(&sbi->s_block);
+	for(i = 0; i < n; i++){
+		if(pfs_free(sb, blk[i], PFS_ALLOC_BLOCK))
+			err = -1;
+	}
+	mutex_unlock(&sbi->s_block);
+	return err;
+}
+
+/*
+ * give count blocks back to the free list under one s_block, bypassing
+ * the per-cpu cache
+ */
+int
+pfs_free_blocks(struct super_block *sb, int64_t *dnos, int count)
+{
+	int	i;
+	int	err = 0;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	mutex_lock(&sbi->s_block);
+	for(i = 0; i < count; i++){
+		if(pfs_free(sb, dnos[i], PFS_ALLOC_BLOCK))
+			err = -1;
+	}
+	mutex_unlock(&sbi->s_block);
+	return err;
+}
+
+/*
+ * give every cached block back to the free list, so that the on-disk
+ * free list is complete when it is written out
+ */
+void
+pfs_drain_bcache(struct super_block *sb)
+{
+	int	cpu, n;
+	int64_t	blk[PFS_BCACHESIZ];
+	struct pfs_bcache *c;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	mutex_lock(&sbi->s_block);
+	for_each_possible_cpu(cpu){
+		c = per_cpu_ptr(sbi->s_bcache, cpu);
+		spin_lock(&c->c_lock);
+		n = c->c_cnt;
+		memcpy(blk, c->c_blk, n * sizeof(int64_t));
+		c->c_cnt = 0;
+		spin_unlock(&c->c_lock);
+		/* pfs_free may sleep, so not under c_lock */
+		while(n)
+			pfs_free(sb, blk[--n], PFS_ALLOC_BLOCK);
+	}
+	mutex_unlock(&sbi->s_block);
+}
+
+int64_t
+pfs_count_bcache(struct super_block *sb)
+{
+	int	cpu;
+	int64_t	cnt = 0;
+
+	for_each_possible_cpu(cpu)
+		cnt += per_cpu_ptr(PFS_SB(sb)->s_bcache, cpu)->c_cnt;
+	return cnt;
+}
+
+/*
+ * free blocks, counting the ones sitting in the per-cpu caches. read
+ * without the locks like statfs does
+ */
+int64_t
+pfs_count_free(struct super_block *sb)
+{
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	return (pfs_get_blocks(sbi) - le64_to_cpu(ACCESS_ONCE(sbi->s_spb->s_bsize))) / PFS_STRS_PER_BLOCK + pfs_count_bcache(sb);
+}
+
+/*
+ * delayed allocation: put n blocks aside for a buffered write until the
+ * writeback allocates them. room is left for the indirect blocks the
+ * writeback may need on top of the data. the reservation is taken before
+ * the check, so concurrent writers see each other's
+ */
+int
+pfs_reserve_blocks(struct inode *inode, int n)
+{
+	struct pfs_sb_info *sbi = PFS_SB(inode->i_sb);
+	int64_t	res = atomic64_add_return(n, &sbi->s_reserved);
+
+	if(pfs_count_free(inode->i_sb) < res + res / PFS_INBLOCKS + PFS_DEPTH){
+		atomic64_sub(n, &sbi->s_reserved);
+		return -ENOSPC;
+	}
+	spin_lock(&inode->i_lock);
+	PFS_I(inode)->i_reserved += n;
+	spin_unlock(&inode->i_lock);
+	return 0;
+}
+
+void
+pfs_release_blocks(struct inode *inode, int64_t n)
+{
+	atomic64_sub(n, &PFS_SB(inode->i_sb)->s_reserved);
+	spin_lock(&inode->i_lock);
+	PFS_I(inode)->i_reserved -= n;
+	spin_unlock(&inode->i_lock);
+}
+
+int
+pfs_init_bcache(struct super_block *sb)
+{
+	int	cpu;
+	struct pfs_bcache *c;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	if(!(sbi->s_bcache = alloc_percpu(struct pfs_bcache)))
+		return -ENOMEM;
+	for_each_possible_cpu(cpu){
+		c = per_cpu_ptr(sbi->s_bcache, cpu);
+		spin_lock_init(&c->c_lock);
+		c->c_cnt = 0;
+	}
+	return 0;
+}
+
+void
+pfs_destroy_bcache(struct super_block *sb)
+{
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	if(!sbi->s_bcache)
+		return;
+	pfs_drain_bcache(sb);
+	free_percpu(sbi->s_bcache);
+	sbi->s_bcache = NULL;
+}
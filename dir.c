@@ -1,5 +1,6 @@
 #include	<linux/fs.h>
 #include	<linux/errno.h>
+#include	<linux/slab.h>
 #include	<linux/version.h>
 #include	<linux/buffer_head.h>
 #include	"pfs.h"
@@ -10,18 +11,52 @@ pfs_block_number(int64_t offset)
 	return offset >> PFS_BLOCKSFT;
 }
 
+/*
+ * start reading count blocks of dir from block on, a run of the map at a
+ * time
+ */
+void
+pfs_dir_readahead(struct inode *dir, sector_t block, int count)
+{
+	int	i, n;
+	struct pfs_map map;
+	sector_t end = min_t(sector_t, block + count, pfs_block_number(dir->i_size + PFS_BLOCKSIZ - 1));
+
+	for(; block < end; block += n){
+		map.m_lblk = block;
+		if(pfs_map_lookup(dir, &map) || map.m_len <= 0)
+			return;
+		n = min_t(sector_t, map.m_len, end - block);
+		for(i = 0; map.m_pblk && i < n; i++)
+			sb_breadahead(dir->i_sb, map.m_pblk / PFS_STRS_PER_BLOCK + i);
+	}
+}
+
+/*
+ * the blocks ahead are read PFS_DIRRA at a time, the next window is
+ * started halfway through the current one. unused records may have been
+ * merged since pos was handed out, a block entered in the middle is
+ * walked from its start up to the first record at or after pos
+ */
 static int
 pfs_readdir(struct file *file, struct dir_context *ctx)
 {
 	int64_t dno;
-	unsigned long off;
+	unsigned long off, n;
+	sector_t ra = 0;
 	struct buffer_head *bh;
 	struct pfs_dir_entry *de;
 	struct inode *inode = file_inode(file);
+	int	resync = ctx->pos > PFS_BLOCKSIZ && (ctx->pos & (PFS_BLOCKSIZ - 1));
 
 	if(ctx->pos == 0) 
 		ctx->pos = PFS_DIRHASHSIZ * sizeof(int64_t) + sizeof(int64_t);
 	for(off = ctx->pos & (PFS_BLOCKSIZ - 1); ctx->pos < inode->i_size; off = ctx->pos & (PFS_BLOCKSIZ - 1)){
+		if(pfs_block_number(ctx->pos) + PFS_DIRRA / 2 >= ra){
+			ra = max_t(sector_t, ra, pfs_block_number(ctx->pos));
+			pfs_dir_readahead(inode, ra, PFS_DIRRA);
+			ra += PFS_DIRRA;
+		}
 		if(!(dno = pfs_get_block_number(inode, pfs_block_number(ctx->pos), 0))) 
 			goto skip;	
 		if(!(bh = sb_bread(inode->i_sb, dno / PFS_STRS_PER_BLOCK))){ 
@@ -29,10 +64,26 @@ pfs_readdir(struct file *file, struct dir_context *ctx)
 				inode->i_sb->s_id, "pfs_readdir", pfs_block_number(ctx->pos), PFS_I(inode)->i_ino);
 			goto skip;
 		}
+		if(resync){
+			resync = 0;
+			for(n = 0; n < off; n += pfs_get_de_size(de)){
+				de = (struct pfs_dir_entry *)((char *)bh->b_data + n);
+				if(pfs_get_de_size(de) < sizeof(*de))
+					break;
+			}
+			if(n > off){
+				ctx->pos += n - off;
+				off = n;
+			}
+			if(off >= PFS_BLOCKSIZ || ctx->pos >= inode->i_size){
+				brelse(bh);
+				continue;
+			}
+		}
 		do{
 			de = (struct pfs_dir_entry *)((char *)bh->b_data + off);
 			if(de->d_ino){ 
-				if(!(dir_emit(ctx, pfs_get_de_name(de), de->d_len, (int32_t)le64_to_cpu(de->d_ino), DT_UNKNOWN))){
+				if(!(dir_emit(ctx, pfs_get_de_name(de), de->d_len, (int32_t)pfs_get_de_ino(de), pfs_get_de_type(de)))){
 					brelse(bh);
 					return 0;
 				}
@@ -49,7 +100,7 @@ skip:
 }
 
 struct pfs_dir_entry *
-pfs_find_entry(struct inode *dir, const struct qstr *qstr, int (*test)(const void *, const void *), 
+pfs_find_entry(struct inode *dir, const void *key, int (*test)(const void *, const void *), 
 	struct pfs_dir_hash_info *hdp, struct pfs_dir_hash_info *hdp1)
 {
 	int64_t	off;
@@ -76,7 +127,7 @@ pfs_find_entry(struct inode *dir, const struct qstr *qstr, int (*test)(const voi
 		}
 		de = (struct pfs_dir_entry *)((char *)bh->b_data + off % PFS_BLOCKSIZ);
 		pfs_add_hdentry(hdp, &de->d_next, off, bh);
-		if(test(qstr, de))
+		if(test(key, de))
 			break;
 	}
 	if(!off)
@@ -86,6 +137,176 @@ out:
 	return NULL;
 }
 
+struct pfs_dir_entry *
+pfs_dir_get(struct inode *dir, int64_t off, struct buffer_head **bhp)
+{
+	int64_t	dno;
+
+	if(!(dno = pfs_get_block_number(dir, pfs_block_number(off), 0)) || 
+		!(*bhp = sb_bread(dir->i_sb, dno / PFS_STRS_PER_BLOCK))){
+		pr_err("pfs: device %s: %s: failed to read block %lld of dir %lld\n", 
+			dir->i_sb->s_id, "pfs_dir_get", pfs_block_number(off), PFS_I(dir)->i_ino);
+		return NULL;
+	}
+	return (struct pfs_dir_entry *)((char *)(*bhp)->b_data + off % PFS_BLOCKSIZ);
+}
+
+/*
+ * block 0 of a directory never moves while it's in core, so the buffer of
+ * the hash block is read once and held until evict. callers get their own
+ * reference and brelse() it as any other buffer
+ */
+struct buffer_head *
+pfs_dir_hblock(struct inode *dir)
+{
+	int64_t	dno;
+	struct buffer_head *bh;
+	struct pfs_inode_info *ei = PFS_I(dir);
+
+	if(!(bh = ACCESS_ONCE(ei->i_hbh))){
+		if(!(dno = pfs_get_block_number(dir, 0, 0)) || !(bh = sb_bread(dir->i_sb, dno / PFS_STRS_PER_BLOCK))){
+			pr_err("pfs: device %s: %s: failed to read the hash block of dir %lld\n", 
+				dir->i_sb->s_id, "pfs_dir_hblock", ei->i_ino);
+			return NULL;
+		}
+		if(cmpxchg(&ei->i_hbh, NULL, bh))	/* lost the race, ours is only a reference */
+			return bh;
+	}
+	get_bh(bh);
+	return bh;
+}
+
+void
+pfs_dir_release(struct inode *dir)
+{
+	struct buffer_head *bh;
+
+	if((bh = xchg(&PFS_I(dir)->i_hbh, NULL)))
+		brelse(bh);
+}
+
+static inline int64_t *
+pfs_dir_heads(struct buffer_head *bh)
+{
+	return (int64_t *)((char *)bh->b_data + sizeof(struct pfs_dir_entry));
+}
+
+/*
+ * point hdp at the bucket head of hash, going down the index blocks its
+ * buckets have been split into. hdp->bh holds a reference of its own.
+ * returns the level of the bucket
+ */
+int
+pfs_dir_bucket(struct inode *dir, struct buffer_head *bh, uint32_t hash, struct pfs_dir_hash_info *hdp)
+{
+	int	level;
+	int64_t	off;
+	struct pfs_dir_entry *de;
+
+	get_bh(bh);
+	pfs_add_hdentry(hdp, (int64_t *)bh->b_data + pfs_hash_slot(hash, 1), 0, bh);
+	for(level = 1; (off = le64_to_cpu(*hdp->p)) & PFS_DIRIDX_FL; level++){
+		brelse(hdp->bh);
+		hdp->bh = NULL;
+		off &= ~PFS_DIRIDX_FL;
+		if(level == PFS_DIRLEVELS || !(de = pfs_dir_get(dir, off, &bh)))
+			return -EIO;
+		pfs_add_hdentry(hdp, pfs_dir_heads(bh) + pfs_hash_slot(hash, level + 1), off, bh);
+	}
+	return level;
+}
+
+/*
+ * fill the rest of the last block with an unused record and add an index
+ * block at the end of the directory
+ */
+static int64_t
+pfs_dir_new_index(struct inode *dir, struct buffer_head *bh, struct buffer_head **ibhp)
+{
+	int	left;
+	int64_t	dno, off;
+	struct buffer_head *ebh;
+	struct pfs_dir_entry *de;
+
+	if((left = dir->i_size % PFS_BLOCKSIZ)){ 
+		if(!(de = pfs_dir_get(dir, dir->i_size, &ebh)))
+			return 0;
+		de->d_ino = 0;
+		de->d_reclen = cpu_to_le16(PFS_BLOCKSIZ - left);
+		de->d_next = ((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED];
+		((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED] = cpu_to_le64(dir->i_size);
+		mark_buffer_dirty_inode(bh, dir);
+		mark_buffer_dirty_inode(ebh, dir);
+		brelse(ebh);
+		pfs_dircache_free(dir, dir->i_size, PFS_BLOCKSIZ - left);
+		truncate_setsize(dir, dir->i_size + PFS_BLOCKSIZ - left);
+		mark_inode_dirty(dir);
+	}
+	off = dir->i_size;
+	if(!(dno = pfs_get_block_number(dir, pfs_block_number(off), 1)))
+		return 0;
+	if(!(*ibhp = sb_bread(dir->i_sb, dno / PFS_STRS_PER_BLOCK)))
+		return 0;
+	memset((*ibhp)->b_data, 0, PFS_BLOCKSIZ);
+	de = (struct pfs_dir_entry *)(*ibhp)->b_data;
+	de->d_reclen = cpu_to_le16(PFS_BLOCKSIZ);
+	truncate_setsize(dir, off + PFS_BLOCKSIZ);
+	mark_inode_dirty(dir);
+	return off;
+}
+
+/*
+ * once the directory has PFS_DIRIDX_MIN blocks, a bucket whose chain grows
+ * past PFS_DIRCHAIN entries is split into an index block. the entries stay
+ * where they are, only their d_next links change. the whole chain is read
+ * and held before any link is touched, a read failing half way would
+ * otherwise lose the entries not yet moved
+ */
+static void
+pfs_dir_split(struct inode *dir, struct buffer_head *bh, struct pfs_dir_hash_info *bk, int level)
+{
+	int	i, n, slot;
+	int64_t	off, next, idx, *heads;
+	struct buffer_head *ebh, *ibh;
+	struct pfs_dir_entry *de;
+	struct pfs_dir_hash_info *ents;
+
+	if(!pfs_has_feature(dir->i_sb, PFS_FEATURE_DIRIDX) || level >= PFS_DIRLEVELS || 
+		pfs_block_number(dir->i_size) < PFS_DIRIDX_MIN)
+		return;
+	for(n = 0, off = le64_to_cpu(*bk->p); off && n <= dir->i_size / sizeof(*de); n++, off = next){
+		if(!(de = pfs_dir_get(dir, off, &ebh)))
+			return;
+		next = pfs_get_de_offset(de);
+		brelse(ebh);
+	}
+	if(n <= PFS_DIRCHAIN || off || !(ents = kmalloc(n * sizeof(*ents), GFP_NOFS)))
+		return;
+	for(i = 0, off = le64_to_cpu(*bk->p); i < n; i++, off = pfs_get_de_offset(de)){
+		if(!(de = pfs_dir_get(dir, off, &ebh)))
+			goto out;
+		pfs_add_hdentry(ents + i, &de->d_next, off, ebh);
+	}
+	if(!(idx = pfs_dir_new_index(dir, bh, &ibh)))
+		goto out;
+	heads = pfs_dir_heads(ibh);
+	for(i = 0; i < n; i++){
+		de = container_of(ents[i].p, struct pfs_dir_entry, d_next);
+		slot = pfs_hash_slot(pfs_get_de_hash(dir->i_sb, de), level + 1);
+		*ents[i].p = heads[slot];
+		heads[slot] = cpu_to_le64(ents[i].off);
+		mark_buffer_dirty_inode(ents[i].bh, dir);
+	}
+	*bk->p = cpu_to_le64(idx | PFS_DIRIDX_FL);
+	mark_buffer_dirty_inode(bk->bh, dir);
+	mark_buffer_dirty_inode(ibh, dir);
+	brelse(ibh);
+out:
+	while(i--)
+		brelse(ents[i].bh);
+	kfree(ents);
+}
+
 int
 pfs_make_empty(struct inode *inode)
 {
@@ -93,24 +314,25 @@ pfs_make_empty(struct inode *inode)
 	struct buffer_head *bh;
 	struct pfs_dir_entry *de;
 
-	if(!(dno = pfs_alloc(inode->i_sb, PFS_ALLOC_BLOCK)))
+	if(!(dno = pfs_new_block(inode->i_sb, PFS_I(inode)->i_goal)))
 		return -ENOSPC;
 	if(!(bh = sb_bread(inode->i_sb, dno / PFS_STRS_PER_BLOCK))){
-		pfs_free(inode->i_sb, dno, PFS_ALLOC_BLOCK);
+		pfs_free_block(inode->i_sb, dno);
 		return -EIO;
 	}
 	memset(bh->b_data, 0, PFS_BLOCKSIZ);
 	de = (struct pfs_dir_entry *)((char *)bh->b_data + PFS_DIRHASH_UNUSED * sizeof(int64_t) + sizeof(int64_t)); 
 	de->d_len = 1;
 	de->d_reclen = cpu_to_le16(sizeof(*de));
-	de->d_ino = cpu_to_le64(PFS_I(inode)->i_ino);
+	pfs_set_de_ino(inode->i_sb, de, PFS_I(inode)->i_ino, S_IFDIR);
 	strcpy(de->d_name, "."); 
 	de = (struct pfs_dir_entry *)((char *)de + sizeof(*de)); 
 	de->d_len = 2;
 	de->d_reclen = cpu_to_le16(sizeof(*de));
-	de->d_ino = cpu_to_le64(PFS_I(inode)->i_ino);
+	pfs_set_de_ino(inode->i_sb, de, PFS_I(inode)->i_ino, S_IFDIR);
 	strcpy(de->d_name, "..");
 	PFS_I(inode)->i_addr[0] = dno; 
+	PFS_I(inode)->i_goal = dno + PFS_STRS_PER_BLOCK;
 	truncate_setsize(inode, PFS_BLOCKSIZ);
 	mark_inode_dirty(inode);
 	mark_buffer_dirty_inode(bh, inode);
@@ -118,54 +340,158 @@ pfs_make_empty(struct inode *inode)
 	return 0;
 }
 
+static int
+pfs_empty_heads(struct inode *dir, int64_t *heads, int n, int level)
+{
+	int	i, empty;
+	int64_t	off;
+	struct buffer_head *bh;
+
+	for(i = 0; level < PFS_DIRLEVELS && i < n; i++){ 
+		if((off = le64_to_cpu(heads[i])) & PFS_DIRIDX_FL)
+			pfs_dir_readahead(dir, pfs_block_number(off & ~PFS_DIRIDX_FL), 1);
+	}
+	for(i = 0; i < n; i++){ 
+		if(!(off = le64_to_cpu(heads[i])))
+			continue;
+		if(!(off & PFS_DIRIDX_FL) || level == PFS_DIRLEVELS || !pfs_dir_get(dir, off & ~PFS_DIRIDX_FL, &bh))
+			return 0;
+		empty = pfs_empty_heads(dir, pfs_dir_heads(bh), PFS_DIRIDXSIZ, level + 1);
+		brelse(bh);
+		if(!empty)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * entries on the chains of n bucket heads, -1 if a block can't be read
+ */
+static int64_t
+pfs_count_heads(struct inode *dir, int64_t *heads, int n, int level)
+{
+	int	i;
+	int64_t	off, sub, cnt = 0, max = dir->i_size / sizeof(struct pfs_dir_entry);
+	struct buffer_head *bh;
+	struct pfs_dir_entry *de;
+
+	for(i = 0; i < n; i++){ 
+		if((off = le64_to_cpu(heads[i])) & PFS_DIRIDX_FL){
+			if(level == PFS_DIRLEVELS || !pfs_dir_get(dir, off & ~PFS_DIRIDX_FL, &bh))
+				return -1;
+			sub = pfs_count_heads(dir, pfs_dir_heads(bh), PFS_DIRIDXSIZ, level + 1);
+			brelse(bh);
+			if(sub < 0)
+				return -1;
+			cnt += sub;
+			continue;
+		}
+		for(; off && cnt <= max; cnt++){
+			if(!(de = pfs_dir_get(dir, off, &bh)))
+				return -1;
+			off = pfs_get_de_offset(de);
+			brelse(bh);
+		}
+	}
+	return cnt;
+}
+
+/*
+ * i_dents reaches the disk apart from the entries, so after a crash it
+ * may be off. a directory whose count dates from before the last crash
+ * (i_dgen behind s_crashes) has it taken again from its bucket heads at
+ * first use
+ */
+void
+pfs_dir_recount(struct inode *dir)
+{
+	int64_t	cnt;
+	struct buffer_head *bh;
+
+	if(!pfs_has_feature(dir->i_sb, PFS_FEATURE_DIRCOUNT) || PFS_I(dir)->i_dgen == pfs_crashes(dir->i_sb))
+		return;
+	if(!(bh = pfs_dir_hblock(dir)))
+		return;
+	down_write(&PFS_I(dir)->i_dlock);
+	if(PFS_I(dir)->i_dgen != pfs_crashes(dir->i_sb) && 
+		(cnt = pfs_count_heads(dir, (int64_t *)bh->b_data, PFS_DIRHASHSIZ, 1)) >= 0){
+		if(cnt != PFS_I(dir)->i_dents)
+			pr_warn("pfs: device %s: %s: dir %lld had %lld entries counted, %lld found\n", dir->i_sb->s_id, 
+				"pfs_dir_recount", PFS_I(dir)->i_ino, PFS_I(dir)->i_dents, cnt);
+		PFS_I(dir)->i_dents = cnt;
+		PFS_I(dir)->i_dgen = pfs_crashes(dir->i_sb);
+		mark_inode_dirty(dir);
+	}
+	up_write(&PFS_I(dir)->i_dlock);
+	brelse(bh);
+}
+
+/*
+ * with PFS_FEATURE_DIRCOUNT a count of zero known right answers. any other is
+ * checked against the bucket heads before rmdir is refused, which is rare,
+ * and put right if it was off. older filesystems never kept the count and
+ * always have their bucket heads scanned
+ */
 int
 pfs_empty_dir(struct inode *dir)
 {
-	int	i;
-	int64_t	dno;
+	int	empty, count = pfs_has_feature(dir->i_sb, PFS_FEATURE_DIRCOUNT);
 	struct buffer_head *bh;
 
-	if(!(dno = pfs_get_block_number(dir, 0, 0))) 
+	pfs_dir_recount(dir);
+	if(count && !PFS_I(dir)->i_dents && PFS_I(dir)->i_dgen == pfs_crashes(dir->i_sb))
+		return 1;
+	if(!(bh = pfs_dir_hblock(dir))) 
                 return 0;
-        if(!(bh = sb_bread(dir->i_sb, dno / PFS_STRS_PER_BLOCK))) 
-                return 0;
-	for(i = 0; i < PFS_DIRHASHSIZ; i++){ 
-		if(((int64_t *)bh->b_data)[i])
-			break;
-	}
+	empty = pfs_empty_heads(dir, (int64_t *)bh->b_data, PFS_DIRHASHSIZ, 1);
 	brelse(bh);
-	return i == PFS_DIRHASHSIZ; 
+	if(count && empty && PFS_I(dir)->i_dents){
+		pr_warn("pfs: device %s: %s: dir %lld had %lld entries counted, none found\n", dir->i_sb->s_id, 
+			"pfs_empty_dir", PFS_I(dir)->i_ino, PFS_I(dir)->i_dents);
+		down_write(&PFS_I(dir)->i_dlock);
+		PFS_I(dir)->i_dents = 0;
+		up_write(&PFS_I(dir)->i_dlock);
+		mark_inode_dirty(dir);
+	}
+	return empty; 
 }
 
 int64_t
 pfs_inode_by_name(struct inode *dir, const struct qstr *qstr)
 {
 	int64_t	ino;
-	struct buffer_head *bh;
+	struct buffer_head *bh, *ibh;
 	struct pfs_dir_entry *de;
+	struct pfs_dir_key key;
 	struct pfs_dir_hash_info hd, hd1; 
 	
 	if(strcmp(qstr->name, ".") == 0) 
 		return PFS_I(dir)->i_ino;
-	if(!(ino = pfs_get_block_number(dir, 0, 0))) 
-		return 0;
-	if(!(bh = sb_bread(dir->i_sb, ino / PFS_STRS_PER_BLOCK))) 
+	pfs_dir_key(dir, qstr, &key);
+	if(strcmp(qstr->name, "..") && (ino = pfs_dircache_ino(dir, &key)) >= 0)
+		return ino;
+	if(!(bh = pfs_dir_hblock(dir))) 
 		return 0;
 	ino = 0; 
 	if(strcmp(qstr->name, "..") == 0){ 
 		de = (struct pfs_dir_entry *)((char *)bh->b_data +  
 			PFS_DIRHASH_UNUSED * sizeof(int64_t) + sizeof(int64_t) + sizeof(*de)); 
-		ino = le64_to_cpu(de->d_ino); 
+		ino = pfs_get_de_ino(de); 
 		brelse(bh);
 		return ino;
 	}
-	pfs_add_hdentry(&hd, (int64_t *)((char *)bh->b_data + pfs_hash(qstr->name) * sizeof(int64_t)), 0, bh); 
-	if((de = pfs_find_entry(dir, qstr, pfs_match, &hd, &hd1))) 
-		ino = le64_to_cpu(de->d_ino);
+	if(pfs_dir_bucket(dir, bh, key.k_hash, &hd) < 0){
+		brelse(bh);
+		return 0;
+	}
+	ibh = hd.bh;
+	if((de = pfs_find_entry(dir, &key, pfs_match, &hd, &hd1))) 
+		ino = pfs_get_de_ino(de);
 	if(hd.bh)
 		brelse(hd.bh);
 	if(hd1.bh)
 		brelse(hd1.bh);
+	brelse(ibh);
 	brelse(bh);
 	return ino;
 }
@@ -178,11 +504,12 @@ pfs_add_link(struct dentry *dentry, struct inode *inode)
 {
 	int	err;
 	int64_t	dno;
-	int	hashval;
+	int	level;
 	int	left, reclen;
 	struct buffer_head *bh;
-	struct pfs_dir_entry *de;
-        struct pfs_dir_hash_info hd, hd1;
+	struct pfs_dir_entry *de, *tail;
+	struct pfs_dir_key key;
+        struct pfs_dir_hash_info hd, hd1, bk;
 	const struct qstr *qstr = &dentry->d_name;	
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
 	struct inode *dir = d_inode(dentry->d_parent);
@@ -191,26 +518,53 @@ pfs_add_link(struct dentry *dentry, struct inode *inode)
 #endif
 
 	err = -EIO;
-        if(!(dno = pfs_get_block_number(dir, 0, 0))) 
-                return err;
-        if(!(bh = sb_bread(dir->i_sb, dno / PFS_STRS_PER_BLOCK))) 
-                return err;
-	hashval = pfs_hash(qstr->name); 
-        pfs_add_hdentry(&hd, (int64_t *)((char *)bh->b_data + PFS_DIRHASH_UNUSED * sizeof(int64_t)), 0, bh); 
-        if((de = pfs_find_entry(dir, qstr, pfs_find_empty_entry, &hd, &hd1))){ 
+	down_write(&PFS_I(dir)->i_dlock);
+        if(!(bh = pfs_dir_hblock(dir))) 
+                goto out2;
+	pfs_dir_key(dir, qstr, &key);
+	if((err = level = pfs_dir_bucket(dir, bh, key.k_hash, &bk)) < 0){
+		brelse(bh);
+		goto out2;
+	}
+	if(pfs_dircache_get(dir))
+		de = pfs_dircache_slot(dir, bh, qstr, &hd, &hd1);
+	else{
+        	pfs_add_hdentry(&hd, (int64_t *)((char *)bh->b_data + PFS_DIRHASH_UNUSED * sizeof(int64_t)), 0, bh); 
+		de = pfs_find_entry(dir, qstr, pfs_find_empty_entry, &hd, &hd1);
+	}
+	err = -EIO;
+        if(de){ 
 		*(hd1.p) = *(hd.p); 
 		mark_buffer_dirty_inode(hd1.bh, dir);
-		*(hd.p) = ((int64_t *)bh->b_data)[hashval]; 
-        	((int64_t *)bh->b_data)[hashval] = cpu_to_le64(hd.off); 
-		mark_buffer_dirty_inode(bh, dir);
+		*(hd.p) = *bk.p; 
+        	*bk.p = cpu_to_le64(hd.off); 
+		mark_buffer_dirty_inode(bk.bh, dir);
 		de->d_len = qstr->len; 
-		de->d_ino = cpu_to_le64(PFS_I(inode)->i_ino);
+		pfs_set_de_ino(dir->i_sb, de, PFS_I(inode)->i_ino, inode->i_mode);
 		memmove(pfs_get_de_name(de), qstr->name, qstr->len + 1); 
+		pfs_set_de_hash(dir->i_sb, de, key.k_hash);
+		reclen = pfs_get_reclen(qstr->len);
+		if((left = pfs_get_de_size(de) - reclen) >= sizeof(*de)){ 
+			/* merged records can be a whole block, give the tail back */
+			de->d_reclen = cpu_to_le16(reclen);
+			tail = (struct pfs_dir_entry *)((char *)de + reclen);
+			tail->d_ino = 0;
+			tail->d_reclen = cpu_to_le16(left);
+			tail->d_next = ((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED];
+			((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED] = cpu_to_le64(hd.off + reclen);
+			mark_buffer_dirty_inode(bh, dir);
+			pfs_dircache_free(dir, hd.off + reclen, left);
+			pfs_dircache_merge(dir, bh, hd.off + reclen);
+		}
 		mark_buffer_dirty_inode(hd.bh, dir); 
+		pfs_dircache_add(dir, key.k_hash, hd.off);
+		PFS_I(dir)->i_dents++;
         	dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
         	mark_inode_dirty(dir);
 		goto out;
 	} 
+	brelse(hd.bh);
+	brelse(hd1.bh);
 expand:
 	hd.bh = hd1.bh = NULL;
 	reclen = pfs_get_reclen(qstr->len);
@@ -226,16 +580,21 @@ add_dentry:
 		pfs_add_hdentry(&hd, &de->d_next, dir->i_size, hd.bh);
 		if(left >= reclen){ 
 			de->d_len = qstr->len;
-			de->d_ino = cpu_to_le64(PFS_I(inode)->i_ino);
+			pfs_set_de_ino(dir->i_sb, de, PFS_I(inode)->i_ino, inode->i_mode);
 			memmove(pfs_get_de_name(de), qstr->name, qstr->len + 1);
+			pfs_set_de_hash(dir->i_sb, de, key.k_hash);
 			de->d_reclen = cpu_to_le16(left - reclen >= sizeof(*de) ? reclen : left);
-			*(hd.p) = ((int64_t *)bh->b_data)[hashval]; 
-                	((int64_t *)bh->b_data)[hashval] = cpu_to_le64(hd.off); 
+			*(hd.p) = *bk.p; 
+                	*bk.p = cpu_to_le64(hd.off); 
+			mark_buffer_dirty_inode(bk.bh, dir);
+			pfs_dircache_add(dir, key.k_hash, hd.off);
+			PFS_I(dir)->i_dents++;
 		}else{ 
 			de->d_ino = 0; 
 			de->d_reclen = cpu_to_le16(left); 
 			*(hd.p) = ((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED]; 
 			((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED] = cpu_to_le64(hd.off);
+			pfs_dircache_free(dir, hd.off, left);
 		}
 		mark_buffer_dirty_inode(bh, dir);
 		mark_buffer_dirty_inode(hd.bh, dir);
@@ -260,8 +619,12 @@ out:
                 brelse(hd1.bh);
         if(!de)
                 goto expand;
+	pfs_dir_split(dir, bh, &bk, level);
 out1:
+	brelse(bk.bh);
         brelse(bh);
+out2:
+	up_write(&PFS_I(dir)->i_dlock);
         return err;
 }
 
@@ -269,8 +632,11 @@ int
 pfs_delete_entry(struct inode *dir, struct pfs_dir_entry *de, struct buffer_head *bh, 
 	struct pfs_dir_hash_info *hdp, struct pfs_dir_hash_info *hdp1)
 {
+	down_write(&PFS_I(dir)->i_dlock);
+	PFS_I(dir)->i_dents--;
 	*(hdp1->p) = *(hdp->p); 
 	mark_buffer_dirty_inode(hdp1->bh, dir);
+	pfs_dircache_del(dir, pfs_get_de_hash(dir->i_sb, de), hdp->off);
 	if(hdp->off + pfs_get_de_size(de) == dir->i_size){ 
 		pfs_truncate(dir, dir->i_size - pfs_get_de_size(de)); 
 		goto out;
@@ -280,7 +646,10 @@ pfs_delete_entry(struct inode *dir, struct pfs_dir_entry *de, struct buffer_head
 	mark_buffer_dirty_inode(bh, dir); 
 	de->d_ino = 0;
 	mark_buffer_dirty_inode(hdp->bh, dir); 
+	pfs_dircache_free(dir, hdp->off, pfs_get_de_size(de));
+	pfs_dircache_merge(dir, bh, hdp->off);
 out:
+	up_write(&PFS_I(dir)->i_dlock);
 	dir->i_ctime = dir->i_mtime = CURRENT_TIME_SEC;
 	mark_inode_dirty(dir);
 	return 0;
@@ -288,7 +657,11 @@ out:
 
 const struct file_operations pfs_dir_operations = {
 	.read		= generic_read_dir,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	.iterate_shared	= pfs_readdir,
+#else
 	.iterate	= pfs_readdir,
+#endif
 	.fsync		= generic_file_fsync,
 	.llseek		= generic_file_llseek,
 };
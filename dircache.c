@@ -0,0 +1,566 @@
+#include	<linux/fs.h>
+#include	<linux/slab.h>
+#include	<linux/list.h>
+#include	<linux/rwsem.h>
+#include	<linux/rbtree.h>
+#include	<linux/spinlock.h>
+#include	<linux/buffer_head.h>
+#include	"pfs.h"
+
+/*
+ * directories of PFS_DIRCACHE_MIN blocks or more get an in-memory index
+ * the first time they are looked up or added to: the 32-bit hash and the
+ * offset of every live entry, and the unused records in the order of the
+ * on-disk PFS_DIRHASH_UNUSED chain. a lookup only reads the blocks of the
+ * entries whose hash matches, a negative one reads none. add_link and
+ * delete_entry keep it in step with the disk under i_dlock, the caches of
+ * a mount sit on s_dlist in lru order and are dropped by the sb shrinker.
+ *
+ * the unused records are also kept by offset and on lists by size class,
+ * so add_link takes a fitting one from the first non-empty class that is
+ * large enough, and a freed record is merged with unused neighbours in
+ * its block
+ */
+
+#define PFS_DSLOT_CLASSES	((sizeof(struct pfs_dir_entry) + 1 + PFS_MAXNAMLEN + 7) / 8 + 1)
+
+struct pfs_dname{
+	struct hlist_node	n_node;
+	uint32_t	n_hash;
+	int64_t	n_off;
+};
+
+struct pfs_dslot{
+	struct list_head	s_list;	/* in the order of the on-disk chain */
+	struct list_head	s_size;
+	struct rb_node	s_node;
+	int64_t	s_off;
+	int	s_len;
+};
+
+struct pfs_dircache{
+	struct list_head	c_lru;
+	struct inode	*c_dir;
+	long	c_count;	/* names and slots, what the shrinker is told */
+	long	c_names;
+	int	c_bits;
+	struct hlist_head	*c_hash;
+	struct list_head	c_free;
+	struct list_head	c_size[PFS_DSLOT_CLASSES];
+	struct rb_root	c_slots;
+};
+
+static inline int
+pfs_dslot_class(int len)
+{
+	return min_t(int, len >> 3, PFS_DSLOT_CLASSES - 1);
+}
+
+static struct pfs_dslot *
+pfs_dslot_find(struct pfs_dircache *dc, int64_t off)
+{
+	struct pfs_dslot *ds;
+	struct rb_node *n = dc->c_slots.rb_node;
+
+	while(n){
+		ds = rb_entry(n, struct pfs_dslot, s_node);
+		if(off < ds->s_off)
+			n = n->rb_left;
+		else if(off > ds->s_off)
+			n = n->rb_right;
+		else
+			return ds;
+	}
+	return NULL;
+}
+
+static void
+pfs_dslot_resize(struct pfs_dircache *dc, struct pfs_dslot *ds, int len)
+{
+	ds->s_len = len;
+	list_move(&ds->s_size, &dc->c_size[pfs_dslot_class(len)]);
+}
+
+static void
+pfs_dslot_del(struct super_block *sb, struct pfs_dircache *dc, struct pfs_dslot *ds)
+{
+	list_del(&ds->s_list);
+	list_del(&ds->s_size);
+	rb_erase(&ds->s_node, &dc->c_slots);
+	kfree(ds);
+	dc->c_count--;
+	atomic_long_dec(&PFS_SB(sb)->s_dnames);
+}
+
+static struct hlist_head *
+pfs_dircache_table(int bits)
+{
+	int	i;
+	struct hlist_head *h;
+
+	if(!(h = kmalloc(sizeof(*h) << bits, GFP_NOFS)))
+		return NULL;
+	for(i = 0; i < (1 << bits); i++)
+		INIT_HLIST_HEAD(&h[i]);
+	return h;
+}
+
+static void
+pfs_dircache_grow(struct pfs_dircache *dc)
+{
+	int	i;
+	struct hlist_head *h;
+	struct hlist_node *t;
+	struct pfs_dname *dn;
+
+	if(dc->c_bits >= PFS_DIRCACHE_BITS || !(h = pfs_dircache_table(dc->c_bits + 1)))
+		return;
+	for(i = 0; i < (1 << dc->c_bits); i++){
+		hlist_for_each_entry_safe(dn, t, &dc->c_hash[i], n_node){
+			hlist_del(&dn->n_node);
+			hlist_add_head(&dn->n_node, &h[dn->n_hash & ((1 << (dc->c_bits + 1)) - 1)]);
+		}
+	}
+	kfree(dc->c_hash);
+	dc->c_hash = h;
+	dc->c_bits++;
+}
+
+static int
+pfs_dircache_insert(struct super_block *sb, struct pfs_dircache *dc, uint32_t hash, int64_t off)
+{
+	struct pfs_dname *dn;
+
+	if(!(dn = kmalloc(sizeof(*dn), GFP_NOFS)))
+		return -ENOMEM;
+	dn->n_hash = hash;
+	dn->n_off = off;
+	hlist_add_head(&dn->n_node, &dc->c_hash[dn->n_hash & ((1 << dc->c_bits) - 1)]);
+	dc->c_count++;
+	atomic_long_inc(&PFS_SB(sb)->s_dnames);
+	if(++dc->c_names > (2L << dc->c_bits))
+		pfs_dircache_grow(dc);
+	return 0;
+}
+
+static int
+pfs_dircache_slot_add(struct super_block *sb, struct pfs_dircache *dc, int64_t off, int len, int tail)
+{
+	struct pfs_dslot *ds, *t;
+	struct rb_node **p = &dc->c_slots.rb_node, *parent = NULL;
+
+	while(*p){
+		parent = *p;
+		t = rb_entry(parent, struct pfs_dslot, s_node);
+		if(off < t->s_off)
+			p = &parent->rb_left;
+		else if(off > t->s_off)
+			p = &parent->rb_right;
+		else
+			return -EIO;
+	}
+	if(!(ds = kmalloc(sizeof(*ds), GFP_NOFS)))
+		return -ENOMEM;
+	ds->s_off = off;
+	ds->s_len = len;
+	rb_link_node(&ds->s_node, parent, p);
+	rb_insert_color(&ds->s_node, &dc->c_slots);
+	list_add(&ds->s_size, &dc->c_size[pfs_dslot_class(len)]);
+	if(tail)
+		list_add_tail(&ds->s_list, &dc->c_free);
+	else
+		list_add(&ds->s_list, &dc->c_free);
+	dc->c_count++;
+	atomic_long_inc(&PFS_SB(sb)->s_dnames);
+	return 0;
+}
+
+static void
+pfs_dircache_destroy(struct super_block *sb, struct pfs_dircache *dc)
+{
+	int	i;
+	struct hlist_node *t;
+	struct pfs_dname *dn;
+	struct pfs_dslot *ds, *n;
+
+	for(i = 0; i < (1 << dc->c_bits); i++){
+		hlist_for_each_entry_safe(dn, t, &dc->c_hash[i], n_node)
+			kfree(dn);
+	}
+	list_for_each_entry_safe(ds, n, &dc->c_free, s_list)
+		kfree(ds);
+	atomic_long_sub(dc->c_count, &PFS_SB(sb)->s_dnames);
+	kfree(dc->c_hash);
+	kfree(dc);
+}
+
+/*
+ * called with i_dlock held
+ */
+static void
+pfs_dircache_invalidate(struct inode *dir)
+{
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+	struct pfs_sb_info *sbi = PFS_SB(dir->i_sb);
+
+	if(!dc)
+		return;
+	spin_lock(&sbi->s_dlock);
+	list_del(&dc->c_lru);
+	spin_unlock(&sbi->s_dlock);
+	PFS_I(dir)->i_dcache = NULL;
+	pfs_dircache_destroy(dir->i_sb, dc);
+}
+
+static struct pfs_dircache *
+pfs_dircache_build(struct inode *dir)
+{
+	int	i, len;
+	int64_t	pos, off, n;
+	sector_t ra = 0;
+	struct buffer_head *bh;
+	struct pfs_dir_entry *de;
+	struct pfs_dircache *dc;
+	struct super_block *sb = dir->i_sb;
+
+	if(!(dc = kzalloc(sizeof(*dc), GFP_NOFS)))
+		return NULL;
+	INIT_LIST_HEAD(&dc->c_free);
+	for(i = 0; i < PFS_DSLOT_CLASSES; i++)
+		INIT_LIST_HEAD(&dc->c_size[i]);
+	dc->c_slots = RB_ROOT;
+	dc->c_dir = dir;
+	dc->c_bits = PFS_DIRCACHE_BITS / 2;
+	if(!(dc->c_hash = pfs_dircache_table(dc->c_bits))){
+		kfree(dc);
+		return NULL;
+	}
+	for(pos = PFS_BLOCKSIZ; pos < dir->i_size; pos += PFS_BLOCKSIZ){
+		if((pos >> PFS_BLOCKSFT) + PFS_DIRRA / 2 >= ra){
+			ra = max_t(sector_t, ra, pos >> PFS_BLOCKSFT);
+			pfs_dir_readahead(dir, ra, PFS_DIRRA);
+			ra += PFS_DIRRA;
+		}
+		if(!pfs_dir_get(dir, pos, &bh))
+			goto out;
+		for(off = 0; off < PFS_BLOCKSIZ && pos + off < dir->i_size; off += len){
+			de = (struct pfs_dir_entry *)((char *)bh->b_data + off);
+			if((len = pfs_get_de_size(de)) < sizeof(*de) ||
+				(de->d_ino && pfs_dircache_insert(sb, dc, pfs_get_de_hash(sb, de), pos + off))){
+				brelse(bh);
+				goto out;
+			}
+		}
+		brelse(bh);
+	}
+	if(!(bh = pfs_dir_hblock(dir)))
+		goto out;
+	off = le64_to_cpu(((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED]);
+	brelse(bh);
+	for(n = dir->i_size / sizeof(*de); off && n; n--, off = pfs_get_de_offset(de)){
+		if(!(de = pfs_dir_get(dir, off, &bh)))
+			goto out;
+		if(pfs_dircache_slot_add(sb, dc, off, pfs_get_de_size(de), 1)){
+			brelse(bh);
+			goto out;
+		}
+		brelse(bh);
+	}
+	if(!off)
+		return dc;
+out:
+	pfs_dircache_destroy(sb, dc);
+	return NULL;
+}
+
+/*
+ * the cache of dir, built if dir is large enough. called with i_dlock held,
+ * for writing unless dir already has one
+ */
+struct pfs_dircache *
+pfs_dircache_get(struct inode *dir)
+{
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+	struct pfs_sb_info *sbi = PFS_SB(dir->i_sb);
+
+	if(!dc){
+		if(dir->i_size < PFS_DIRCACHE_MIN * PFS_BLOCKSIZ || !(dc = pfs_dircache_build(dir)))
+			return NULL;
+		PFS_I(dir)->i_dcache = dc;
+		spin_lock(&sbi->s_dlock);
+		list_add(&dc->c_lru, &sbi->s_dlist);
+		spin_unlock(&sbi->s_dlock);
+		return dc;
+	}
+	spin_lock(&sbi->s_dlock);
+	list_move(&dc->c_lru, &sbi->s_dlist);
+	spin_unlock(&sbi->s_dlock);
+	return dc;
+}
+
+/*
+ * the inode number of the name of key in dir, 0 if it isn't there, -1 if
+ * dir has no cache. lookups run in parallel under the shared i_rwsem and
+ * only share i_dlock, the cache is built with it held for writing
+ */
+int64_t
+pfs_dircache_ino(struct inode *dir, const struct pfs_dir_key *key)
+{
+	int	n;
+	int64_t	ino = -1;
+	uint32_t hash = key->k_hash;
+	struct pfs_dname *dn;
+	struct buffer_head *bh;
+	struct pfs_dir_entry *de;
+	struct pfs_dircache *dc;
+
+	down_read(&PFS_I(dir)->i_dlock);
+	if(!PFS_I(dir)->i_dcache){
+		if(dir->i_size < PFS_DIRCACHE_MIN * PFS_BLOCKSIZ)
+			goto out;
+		up_read(&PFS_I(dir)->i_dlock);
+		down_write(&PFS_I(dir)->i_dlock);
+		dc = pfs_dircache_get(dir);
+		downgrade_write(&PFS_I(dir)->i_dlock);
+		if(!dc)
+			goto out;
+	}else
+		dc = pfs_dircache_get(dir);
+	ino = 0;
+	n = 0;
+	hlist_for_each_entry(dn, &dc->c_hash[hash & ((1 << dc->c_bits) - 1)], n_node)
+		n += dn->n_hash == hash;
+	if(n > 1){ 
+		/* colliding names, start the reads of all their blocks at once */
+		hlist_for_each_entry(dn, &dc->c_hash[hash & ((1 << dc->c_bits) - 1)], n_node){
+			if(dn->n_hash == hash)
+				pfs_dir_readahead(dir, dn->n_off >> PFS_BLOCKSFT, 1);
+		}
+	}
+	hlist_for_each_entry(dn, &dc->c_hash[hash & ((1 << dc->c_bits) - 1)], n_node){
+		if(dn->n_hash != hash)
+			continue;
+		if(!(de = pfs_dir_get(dir, dn->n_off, &bh))){
+			ino = -1;
+			break;
+		}
+		if(de->d_ino && pfs_match(key, de))
+			ino = pfs_get_de_ino(de);
+		brelse(bh);
+		if(ino)
+			break;
+	}
+out:
+	up_read(&PFS_I(dir)->i_dlock);
+	return ino;
+}
+
+/*
+ * take an unused record that fits qstr off the chain like pfs_find_entry
+ * does: hdp at the record, hdp1 at the link before it. every record of
+ * the class searched first is large enough
+ */
+struct pfs_dir_entry *
+pfs_dircache_slot(struct inode *dir, struct buffer_head *bh, const struct qstr *qstr,
+	struct pfs_dir_hash_info *hdp, struct pfs_dir_hash_info *hdp1)
+{
+	int	c;
+	struct buffer_head *pbh;
+	struct pfs_dir_entry *de, *pde;
+	struct pfs_dslot *ds, *prev;
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+
+	hdp->bh = hdp1->bh = NULL;
+	for(c = pfs_dslot_class(pfs_get_reclen(qstr->len) + 7); c < PFS_DSLOT_CLASSES && list_empty(&dc->c_size[c]); c++)
+		;
+	if(c == PFS_DSLOT_CLASSES)
+		return NULL;
+	ds = list_first_entry(&dc->c_size[c], struct pfs_dslot, s_size);
+	prev = ds->s_list.prev == &dc->c_free ? NULL : list_prev_entry(ds, s_list);
+	if(!(de = pfs_dir_get(dir, ds->s_off, &hdp->bh)))
+		goto out;
+	pfs_add_hdentry(hdp, &de->d_next, ds->s_off, hdp->bh);
+	if(!prev){
+		get_bh(bh);
+		pfs_add_hdentry(hdp1, (int64_t *)bh->b_data + PFS_DIRHASH_UNUSED, 0, bh);
+	}else{
+		if(!(pde = pfs_dir_get(dir, prev->s_off, &pbh)))
+			goto out;
+		pfs_add_hdentry(hdp1, &pde->d_next, prev->s_off, pbh);
+	}
+	if(le64_to_cpu(*hdp1->p) != ds->s_off){
+		pr_err("pfs: device %s: %s: unused chain of dir %lld out of step\n",
+			dir->i_sb->s_id, "pfs_dircache_slot", PFS_I(dir)->i_ino);
+		goto out;
+	}
+	pfs_dslot_del(dir->i_sb, dc, ds);
+	return de;
+out:
+	brelse(hdp->bh);
+	brelse(hdp1->bh);
+	hdp->bh = hdp1->bh = NULL;
+	pfs_dircache_invalidate(dir);
+	return NULL;
+}
+
+void
+pfs_dircache_add(struct inode *dir, uint32_t hash, int64_t off)
+{
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+
+	if(dc && pfs_dircache_insert(dir->i_sb, dc, hash, off))
+		pfs_dircache_invalidate(dir);
+}
+
+void
+pfs_dircache_del(struct inode *dir, uint32_t hash, int64_t off)
+{
+	struct pfs_dname *dn;
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+
+	if(!dc)
+		return;
+	hlist_for_each_entry(dn, &dc->c_hash[hash & ((1 << dc->c_bits) - 1)], n_node){
+		if(dn->n_off == off){
+			hlist_del(&dn->n_node);
+			kfree(dn);
+			dc->c_count--;
+			dc->c_names--;
+			atomic_long_dec(&PFS_SB(dir->i_sb)->s_dnames);
+			return;
+		}
+	}
+}
+
+/*
+ * a record put at the head of the unused chain
+ */
+void
+pfs_dircache_free(struct inode *dir, int64_t off, int len)
+{
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+
+	if(dc && pfs_dircache_slot_add(dir->i_sb, dc, off, len, 0))
+		pfs_dircache_invalidate(dir);
+}
+
+/*
+ * take ds off the on-disk unused chain and out of the cache
+ */
+static int
+pfs_dircache_unchain(struct inode *dir, struct buffer_head *bh, struct pfs_dircache *dc, struct pfs_dslot *ds)
+{
+	int64_t	next = 0;
+	struct buffer_head *pbh;
+	struct pfs_dir_entry *pde;
+
+	if(!list_is_last(&ds->s_list, &dc->c_free))
+		next = list_next_entry(ds, s_list)->s_off;
+	if(ds->s_list.prev == &dc->c_free){
+		((int64_t *)bh->b_data)[PFS_DIRHASH_UNUSED] = cpu_to_le64(next);
+		mark_buffer_dirty_inode(bh, dir);
+	}else{
+		if(!(pde = pfs_dir_get(dir, list_prev_entry(ds, s_list)->s_off, &pbh)))
+			return -EIO;
+		pde->d_next = cpu_to_le64(next);
+		mark_buffer_dirty_inode(pbh, dir);
+		brelse(pbh);
+	}
+	pfs_dslot_del(dir->i_sb, dc, ds);
+	return 0;
+}
+
+/*
+ * grow the unused record at into by the one after it, which leaves the
+ * chain. records never cross a block so neither does the result
+ */
+static int
+pfs_dircache_join(struct inode *dir, struct buffer_head *bh, struct pfs_dircache *dc, struct pfs_dslot *into, struct pfs_dslot *ds)
+{
+	int	len = into->s_len + ds->s_len;
+	struct buffer_head *ebh;
+	struct pfs_dir_entry *de;
+
+	if(!(de = pfs_dir_get(dir, into->s_off, &ebh)))
+		return -EIO;
+	if(pfs_dircache_unchain(dir, bh, dc, ds)){
+		brelse(ebh);
+		return -EIO;
+	}
+	de->d_reclen = cpu_to_le16(len);
+	mark_buffer_dirty_inode(ebh, dir);
+	brelse(ebh);
+	pfs_dslot_resize(dc, into, len);
+	return 0;
+}
+
+/*
+ * merge the record just freed at off with the unused records right
+ * before and after it in its block. bh is the hash block
+ */
+void
+pfs_dircache_merge(struct inode *dir, struct buffer_head *bh, int64_t off)
+{
+	struct rb_node *n;
+	struct pfs_dslot *ds, *t;
+	struct pfs_dircache *dc = PFS_I(dir)->i_dcache;
+
+	if(!dc || !(ds = pfs_dslot_find(dc, off)))
+		return;
+	if((off + ds->s_len) % PFS_BLOCKSIZ && (t = pfs_dslot_find(dc, off + ds->s_len)) && 
+		pfs_dircache_join(dir, bh, dc, ds, t))
+		goto out;
+	if(!(off % PFS_BLOCKSIZ) || !(n = rb_prev(&ds->s_node)))
+		return;
+	t = rb_entry(n, struct pfs_dslot, s_node);
+	if(t->s_off + t->s_len == off && pfs_dircache_join(dir, bh, dc, t, ds))
+		goto out;
+	return;
+out:
+	pfs_dircache_invalidate(dir);
+}
+
+void
+pfs_dircache_drop(struct inode *dir)
+{
+	down_write(&PFS_I(dir)->i_dlock);
+	pfs_dircache_invalidate(dir);
+	up_write(&PFS_I(dir)->i_dlock);
+}
+
+long
+pfs_dircache_count(struct super_block *sb)
+{
+	return atomic_long_read(&PFS_SB(sb)->s_dnames);
+}
+
+/*
+ * drop least recently used caches until nr objects are gone, skipping the
+ * ones in use
+ */
+long
+pfs_dircache_scan(struct super_block *sb, long nr)
+{
+	long	freed = 0;
+	LIST_HEAD(dispose);
+	struct pfs_inode_info *ei;
+	struct pfs_dircache *dc, *n;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	spin_lock(&sbi->s_dlock);
+	list_for_each_entry_safe_reverse(dc, n, &sbi->s_dlist, c_lru){
+		if(freed >= nr)
+			break;
+		ei = PFS_I(dc->c_dir);
+		if(!down_write_trylock(&ei->i_dlock))
+			continue;
+		list_move(&dc->c_lru, &dispose);
+		ei->i_dcache = NULL;
+		up_write(&ei->i_dlock);
+		freed += dc->c_count;
+	}
+	spin_unlock(&sbi->s_dlock);
+	list_for_each_entry_safe(dc, n, &dispose, c_lru)
+		pfs_dircache_destroy(sb, dc);
+	return freed;
+}
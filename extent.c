@@ -0,0 +1,511 @@
+#include	<linux/fs.h>
+#include	<linux/slab.h>
+#include	<linux/string.h>
+#include	<linux/buffer_head.h>
+#include	"pfs.h"
+
+/*
+ * the extent blocks of the file, records past PFS_IEXTS live in them. all
+ * records are little endian, in core as well as on disk
+ */
+typedef struct{
+	struct buffer_head *bh[PFS_EXT_BLOCK];
+}Extblocks;
+
+static inline int
+pfs_ext_count(struct inode *inode)
+{
+	return PFS_I(inode)->i_esiz & ~PFS_EXT_FL;
+}
+
+static inline void
+pfs_ext_set_count(struct inode *inode, int n)
+{
+	PFS_I(inode)->i_esiz = PFS_EXT_FL | n;
+	mark_inode_dirty(inode);
+}
+
+static void
+pfs_ext_release(Extblocks *eb)
+{
+	int	i;
+
+	for(i = 0; i < PFS_EXT_BLOCK; i++)
+		brelse(eb->bh[i]);
+}
+
+static int
+pfs_ext_load(struct inode *inode, Extblocks *eb)
+{
+	int	i;
+
+	memset(eb, 0, sizeof(*eb));
+	for(i = 0; i < PFS_EXT_BLOCK && PFS_I(inode)->i_ext[i]; i++){
+		if(!(eb->bh[i] = sb_bread(inode->i_sb, PFS_I(inode)->i_ext[i] / PFS_STRS_PER_BLOCK))){
+			pr_warn("pfs: device %s: %s: failed to read extents of inode %lld\n",
+				inode->i_sb->s_id, "pfs_ext_load", PFS_I(inode)->i_ino);
+			pfs_ext_release(eb);
+			return -EIO;
+		}
+	}
+	return 0;
+}
+
+static inline struct pfs_extent *
+pfs_ext_rec(struct inode *inode, Extblocks *eb, int i)
+{
+	if(i < PFS_IEXTS)
+		return (struct pfs_extent *)PFS_I(inode)->i_addr + i;
+	i -= PFS_IEXTS;
+	return (struct pfs_extent *)eb->bh[i / PFS_EXTS_PER_BLOCK]->b_data + i % PFS_EXTS_PER_BLOCK;
+}
+
+static inline void
+pfs_ext_dirty(struct inode *inode, Extblocks *eb, int i)
+{
+	if(i < PFS_IEXTS)
+		mark_inode_dirty(inode);
+	else
+		mark_buffer_dirty_inode(eb->bh[(i - PFS_IEXTS) / PFS_EXTS_PER_BLOCK], inode);
+}
+
+static inline uint32_t
+pfs_ext_len(struct pfs_extent *e)
+{
+	return le32_to_cpu(e->e_len) & PFS_EXT_MAXLEN;
+}
+
+static inline uint32_t
+pfs_ext_unwritten(struct pfs_extent *e)
+{
+	return le32_to_cpu(e->e_len) & PFS_EXT_UNWRITTEN;
+}
+
+/*
+ * len carries PFS_EXT_UNWRITTEN when the extent is unwritten
+ */
+static inline void
+pfs_ext_set(struct pfs_extent *e, uint32_t lblk, int64_t pblk, uint32_t len)
+{
+	e->e_lblk = cpu_to_le32(lblk);
+	e->e_pblk = cpu_to_le64(pblk);
+	e->e_len = cpu_to_le32(len);
+}
+
+/*
+ * index of the last extent starting at or before lblk, -1 if none does
+ */
+static int
+pfs_ext_search(struct inode *inode, Extblocks *eb, int n, uint32_t lblk)
+{
+	int	lo = 0, hi = n - 1, mid, ret = -1;
+
+	while(lo <= hi){
+		mid = (lo + hi) / 2;
+		if(le32_to_cpu(pfs_ext_rec(inode, eb, mid)->e_lblk) <= lblk){
+			ret = mid;
+			lo = mid + 1;
+		}else
+			hi = mid - 1;
+	}
+	return ret;
+}
+
+static int
+pfs_ext_insert(struct inode *inode, Extblocks *eb, int n, int pos, uint32_t lblk, int64_t pblk, uint32_t len)
+{
+	int	i, k;
+
+	if(n >= PFS_IEXTS && !((n - PFS_IEXTS) % PFS_EXTS_PER_BLOCK) &&
+		!PFS_I(inode)->i_ext[k = (n - PFS_IEXTS) / PFS_EXTS_PER_BLOCK]){
+		int64_t	dno;
+		struct buffer_head *bh;
+
+		if(!(dno = pfs_new_block(inode->i_sb, PFS_I(inode)->i_goal)))
+			return -ENOSPC;
+		if(!(bh = sb_bread(inode->i_sb, dno / PFS_STRS_PER_BLOCK))){
+			pfs_free_block(inode->i_sb, dno);
+			return -EIO;
+		}
+		memset(bh->b_data, 0, PFS_BLOCKSIZ);
+		mark_buffer_dirty_inode(bh, inode);
+		eb->bh[k] = bh;
+		PFS_I(inode)->i_ext[k] = dno;
+		pfs_add_blocks(inode, 1);
+	}
+	for(i = n; i > pos; i--){
+		*pfs_ext_rec(inode, eb, i) = *pfs_ext_rec(inode, eb, i - 1);
+		pfs_ext_dirty(inode, eb, i);
+	}
+	pfs_ext_set(pfs_ext_rec(inode, eb, pos), lblk, pblk, len);
+	pfs_ext_dirty(inode, eb, pos);
+	pfs_ext_set_count(inode, n + 1);
+	return 0;
+}
+
+static void
+pfs_ext_delete(struct inode *inode, Extblocks *eb, int n, int pos)
+{
+	int	i;
+
+	for(i = pos; i < n - 1; i++){
+		*pfs_ext_rec(inode, eb, i) = *pfs_ext_rec(inode, eb, i + 1);
+		pfs_ext_dirty(inode, eb, i);
+	}
+	pfs_ext_set_count(inode, n - 1);
+}
+
+/*
+ * point the indirect map at the first limit blocks of the count extents of
+ * tab (or clear those pointers). returns the number of blocks done, or
+ * -(done + 1) when setting them failed
+ */
+static int64_t
+pfs_ext_to_bmap(struct inode *inode, struct pfs_extent *tab, int count, int64_t limit, int unset)
+{
+	int	i, ret;
+	uint32_t j, len;
+	int64_t	pblk, done = 0;
+
+	for(i = 0; i < count && done < limit; i++){
+		len = pfs_ext_len(tab + i);
+		pblk = le64_to_cpu(tab[i].e_pblk) | (pfs_ext_unwritten(tab + i) ? PFS_UNWRITTEN : 0);
+		for(j = 0; j < len && done < limit; j += ret, done += ret){
+			ret = pfs_set_blocks(inode, le32_to_cpu(tab[i].e_lblk) + j,
+				unset ? 0 : pblk + (int64_t)j * PFS_STRS_PER_BLOCK, min_t(int64_t, len - j, limit - done));
+			if(ret <= 0)
+				return unset ? done : -(done + 1);
+		}
+	}
+	return done;
+}
+
+/*
+ * the extent table is full: move the file over to the indirect map. on
+ * failure the pointers set so far are cleared, the indirect blocks freed
+ * and the extents put back
+ */
+static int
+pfs_ext_convert(struct inode *inode, Extblocks *eb, int n)
+{
+	int	i;
+	int64_t	done, ext[PFS_NEXT];
+	struct pfs_extent *tab;
+
+	if(!(tab = kmalloc(n * sizeof(*tab), GFP_NOFS)))
+		return -ENOMEM;
+	for(i = 0; i < n; i++)
+		tab[i] = *pfs_ext_rec(inode, eb, i);
+	memmove(ext, PFS_I(inode)->i_ext, sizeof(ext));
+	PFS_I(inode)->i_esiz = 0;
+	memset(PFS_I(inode)->i_ext, 0, sizeof(PFS_I(inode)->i_ext));
+	memset(PFS_I(inode)->i_addr, 0, sizeof(PFS_I(inode)->i_addr));
+	if((done = pfs_ext_to_bmap(inode, tab, n, LLONG_MAX, 0)) < 0){
+		pfs_ext_to_bmap(inode, tab, n, -done - 1, 1);
+		pfs_truncate_bmap(inode, 0);
+		memmove(PFS_I(inode)->i_addr, tab, sizeof(PFS_I(inode)->i_addr));
+		memmove(PFS_I(inode)->i_ext, ext, sizeof(ext));
+		pfs_ext_set_count(inode, n);
+		kfree(tab);
+		return -ENOSPC;
+	}
+	for(i = 0; i < PFS_EXT_BLOCK; i++){
+		if(!ext[i])
+			continue;
+		bforget(eb->bh[i]);
+		eb->bh[i] = NULL;
+		pfs_free_block(inode->i_sb, ext[i]);
+		pfs_add_blocks(inode, -1);
+	}
+	mark_inode_dirty(inode);
+	kfree(tab);
+	return 0;
+}
+
+/*
+ * allocate the hole of want blocks at map->m_lblk, i is the extent before
+ * it. the new run is merged into its neighbours when it continues them
+ * and is written or unwritten like them
+ */
+static int
+pfs_ext_alloc(struct inode *inode, Extblocks *eb, int n, int i, int want, struct pfs_map *map, uint32_t uw)
+{
+	int	k, cnt, err;
+	int	pm = 0, nm = 0;
+	uint32_t plen = 0, nlen = 0;
+	int64_t	goal = PFS_I(inode)->i_goal, dnos[PFS_ALLOCBATCH];
+	struct pfs_extent *pe = NULL, *ne = NULL;
+	struct super_block *sb = inode->i_sb;
+
+	if(i >= 0){
+		pe = pfs_ext_rec(inode, eb, i);
+		plen = pfs_ext_len(pe);
+		goal = le64_to_cpu(pe->e_pblk) + (int64_t)plen * PFS_STRS_PER_BLOCK;
+	}
+	if(i + 1 < n){
+		ne = pfs_ext_rec(inode, eb, i + 1);
+		nlen = pfs_ext_len(ne);
+	}
+	want = min(want, PFS_ALLOCBATCH);
+	if(want == 1)
+		cnt = (dnos[0] = pfs_new_block(sb, goal)) ? 1 : 0;
+	else
+		cnt = pfs_alloc_blocks(sb, goal, want, dnos);
+	if(!cnt)
+		return -ENOSPC;
+	for(k = 1; k < cnt && dnos[k] == dnos[0] + k * PFS_STRS_PER_BLOCK; k++)
+		;
+	while(cnt > k)
+		pfs_free_block(sb, dnos[--cnt]);
+	if(pe && le32_to_cpu(pe->e_lblk) + plen == map->m_lblk && goal == dnos[0] && pfs_ext_unwritten(pe) == uw)
+		pm = plen + cnt <= PFS_EXT_MAXLEN;
+	if(ne && le32_to_cpu(ne->e_lblk) == map->m_lblk + cnt && le64_to_cpu(ne->e_pblk) == dnos[0] + cnt * PFS_STRS_PER_BLOCK &&
+		pfs_ext_unwritten(ne) == uw)
+		nm = nlen + cnt <= PFS_EXT_MAXLEN;
+	if(pm && nm && (int64_t)plen + cnt + nlen <= PFS_EXT_MAXLEN){
+		pe->e_len = cpu_to_le32((plen + cnt + nlen) | uw);
+		pfs_ext_dirty(inode, eb, i);
+		pfs_ext_delete(inode, eb, n, i + 1);
+	}else if(pm){
+		pe->e_len = cpu_to_le32((plen + cnt) | uw);
+		pfs_ext_dirty(inode, eb, i);
+	}else if(nm){
+		pfs_ext_set(ne, map->m_lblk, dnos[0], (nlen + cnt) | uw);
+		pfs_ext_dirty(inode, eb, i + 1);
+	}else if((err = pfs_ext_insert(inode, eb, n, i + 1, map->m_lblk, dnos[0], cnt | uw))){
+		while(cnt)
+			pfs_free_block(sb, dnos[--cnt]);
+		return err;
+	}
+	PFS_I(inode)->i_goal = dnos[cnt - 1] + PFS_STRS_PER_BLOCK;
+	pfs_add_blocks(inode, cnt);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	map->m_pblk = dnos[0];
+	map->m_len = cnt;
+	map->m_flags |= uw ? PFS_MAP_NEW | PFS_MAP_UNWRITTEN : PFS_MAP_NEW;
+	return 0;
+}
+
+/*
+ * turn the blocks of the unwritten extent i from map->m_lblk on, up to
+ * m_len of them, into a written extent. the parts before and after stay
+ * unwritten extents of their own
+ */
+static int
+pfs_ext_written(struct inode *inode, Extblocks *eb, int n, int i, struct pfs_map *map)
+{
+	int	err;
+	struct pfs_extent *e = pfs_ext_rec(inode, eb, i);
+	uint32_t lblk = le32_to_cpu(e->e_lblk), len = pfs_ext_len(e);
+	uint32_t s = map->m_lblk, t = min_t(int64_t, (int64_t)lblk + len, map->m_lblk + map->m_len);
+	int64_t	pblk = le64_to_cpu(e->e_pblk);
+
+	if(n + (s > lblk) + (t < lblk + len) > PFS_MAXEXTS){
+		if((err = pfs_ext_convert(inode, eb, n)))
+			return err;
+		return __pfs_map_blocks(inode, map, PFS_CREATE);
+	}
+	if(s > lblk){
+		if((err = pfs_ext_insert(inode, eb, n, i + 1, s, pblk + (int64_t)(s - lblk) * PFS_STRS_PER_BLOCK, t - s)))
+			return err;
+		e->e_len = cpu_to_le32((s - lblk) | PFS_EXT_UNWRITTEN);
+		pfs_ext_dirty(inode, eb, i);
+		n++;
+		i++;
+	}else{
+		pfs_ext_set(e, s, pblk, t - s);
+		pfs_ext_dirty(inode, eb, i);
+	}
+	if(t < lblk + len && (err = pfs_ext_insert(inode, eb, n, i + 1, t, 
+		pblk + (int64_t)(t - lblk) * PFS_STRS_PER_BLOCK, (lblk + len - t) | PFS_EXT_UNWRITTEN))){
+		if(s > lblk)
+			pfs_ext_delete(inode, eb, n, i--);
+		pfs_ext_set(pfs_ext_rec(inode, eb, i), lblk, pblk, len | PFS_EXT_UNWRITTEN);
+		pfs_ext_dirty(inode, eb, i);
+		return err;
+	}
+	pfs_mcache_clear(inode);
+	mark_inode_dirty(inode);
+	map->m_pblk = pblk + (int64_t)(s - lblk) * PFS_STRS_PER_BLOCK;
+	map->m_len = t - s;
+	map->m_flags |= PFS_MAP_NEW;
+	return 0;
+}
+
+int
+pfs_ext_map_blocks(struct inode *inode, struct pfs_map *map, int create)
+{
+	int	i, n, err;
+	uint32_t lblk, len;
+	int64_t	hole;
+	Extblocks eb;
+	struct pfs_extent *e;
+
+	if(map->m_lblk >= PFS_MAXBLOCKS)
+		return -EIO;
+	if((err = pfs_ext_load(inode, &eb)))
+		return err;
+	n = pfs_ext_count(inode);
+	if((i = pfs_ext_search(inode, &eb, n, map->m_lblk)) >= 0){
+		e = pfs_ext_rec(inode, &eb, i);
+		lblk = le32_to_cpu(e->e_lblk);
+		len = pfs_ext_len(e);
+		if(map->m_lblk < (sector_t)lblk + len){
+			if(pfs_ext_unwritten(e) && create == PFS_CREATE){
+				err = pfs_ext_written(inode, &eb, n, i, map);
+				goto out;
+			}
+			if(pfs_ext_unwritten(e))
+				map->m_flags |= PFS_MAP_UNWRITTEN;
+			map->m_pblk = le64_to_cpu(e->e_pblk) + (map->m_lblk - lblk) * PFS_STRS_PER_BLOCK;
+			map->m_len = min_t(int64_t, map->m_len, lblk + len - map->m_lblk);
+			goto out;
+		}
+	}
+	if(i + 1 < n)
+		hole = le32_to_cpu(pfs_ext_rec(inode, &eb, i + 1)->e_lblk) - map->m_lblk;
+	else
+		hole = PFS_MAXBLOCKS - map->m_lblk;
+	if(!create){
+		map->m_len = min_t(int64_t, hole, INT_MAX);
+		goto out;
+	}
+	if(n == PFS_MAXEXTS){
+		if(!(err = pfs_ext_convert(inode, &eb, n)))
+			err = __pfs_map_blocks(inode, map, create);
+		goto out;
+	}
+	err = pfs_ext_alloc(inode, &eb, n, i, min_t(int64_t, map->m_len, hole), map, 
+		create == PFS_CREATE_UNWRITTEN ? PFS_EXT_UNWRITTEN : 0);
+out:
+	pfs_ext_release(&eb);
+	return err;
+}
+
+/*
+ * give the run back PFS_ALLOCBATCH blocks at a time
+ */
+static void
+pfs_ext_free(struct inode *inode, int64_t pblk, uint32_t cnt)
+{
+	int	k;
+	uint32_t j;
+	int64_t	dnos[PFS_ALLOCBATCH];
+
+	for(j = 0; j < cnt; j += k){
+		for(k = 0; k < PFS_ALLOCBATCH && j + k < cnt; k++)
+			dnos[k] = pblk + (int64_t)(j + k) * PFS_STRS_PER_BLOCK;
+		pfs_free_blocks(inode->i_sb, dnos, k);
+	}
+	pfs_add_blocks(inode, -(int64_t)cnt);
+}
+
+/*
+ * free the blocks from block on, then the extent blocks that no longer
+ * hold any record
+ */
+void
+pfs_ext_truncate(struct inode *inode, sector_t block)
+{
+	int	n, k;
+	uint32_t lblk, len, cut;
+	int64_t	pblk;
+	Extblocks eb;
+	struct pfs_extent *e;
+	struct super_block *sb = inode->i_sb;
+
+	if(pfs_ext_load(inode, &eb))
+		return;
+	for(n = pfs_ext_count(inode); n > 0; n--){
+		e = pfs_ext_rec(inode, &eb, n - 1);
+		lblk = le32_to_cpu(e->e_lblk);
+		len = pfs_ext_len(e);
+		pblk = le64_to_cpu(e->e_pblk);
+		if((sector_t)lblk + len <= block)
+			break;
+		cut = lblk >= block ? len : lblk + len - block;
+		pfs_ext_free(inode, pblk + (int64_t)(len - cut) * PFS_STRS_PER_BLOCK, cut);
+		if(cut < len){
+			e->e_len = cpu_to_le32((len - cut) | pfs_ext_unwritten(e));
+			pfs_ext_dirty(inode, &eb, n - 1);
+			break;
+		}
+	}
+	pfs_ext_set_count(inode, n);
+	for(k = PFS_EXT_BLOCK - 1; k >= 0; k--){
+		if(!PFS_I(inode)->i_ext[k] || n > PFS_IEXTS + k * PFS_EXTS_PER_BLOCK)
+			continue;
+		bforget(eb.bh[k]);
+		eb.bh[k] = NULL;
+		pfs_free_block(sb, PFS_I(inode)->i_ext[k]);
+		PFS_I(inode)->i_ext[k] = 0;
+		pfs_add_blocks(inode, -1);
+	}
+	pfs_ext_release(&eb);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+}
+
+/*
+ * free the blocks of [start, end). an extent split in two when the table
+ * is full sends the file over to the indirect map, the caller then punches
+ * the range again there
+ */
+int
+pfs_ext_punch(struct inode *inode, sector_t start, sector_t end)
+{
+	int	i, n, err = 0;
+	uint32_t lblk, len, uw;
+	int64_t	pblk, s, t;
+	Extblocks eb;
+	struct pfs_extent *e;
+
+	if((err = pfs_ext_load(inode, &eb)))
+		return err;
+	n = pfs_ext_count(inode);
+	if((i = pfs_ext_search(inode, &eb, n, start)) < 0)
+		i = 0;
+	while(i < n){
+		e = pfs_ext_rec(inode, &eb, i);
+		lblk = le32_to_cpu(e->e_lblk);
+		len = pfs_ext_len(e);
+		uw = pfs_ext_unwritten(e);
+		pblk = le64_to_cpu(e->e_pblk);
+		if(lblk >= end)
+			break;
+		if((sector_t)lblk + len <= start){
+			i++;
+			continue;
+		}
+		s = max_t(int64_t, lblk, start);
+		t = min_t(int64_t, (int64_t)lblk + len, end);
+		if(s > lblk && t < (int64_t)lblk + len){
+			if(n == PFS_MAXEXTS){
+				err = pfs_ext_convert(inode, &eb, n);
+				break;
+			}
+			if((err = pfs_ext_insert(inode, &eb, n, i + 1, t, pblk + (t - lblk) * PFS_STRS_PER_BLOCK, (lblk + len - t) | uw)))
+				break;
+			e->e_len = cpu_to_le32((s - lblk) | uw);
+			pfs_ext_dirty(inode, &eb, i);
+			pfs_ext_free(inode, pblk + (s - lblk) * PFS_STRS_PER_BLOCK, t - s);
+			break;
+		}
+		pfs_ext_free(inode, pblk + (s - lblk) * PFS_STRS_PER_BLOCK, t - s);
+		if(s == lblk && t == (int64_t)lblk + len){
+			pfs_ext_delete(inode, &eb, n--, i);
+			continue;
+		}
+		if(s == lblk)
+			pfs_ext_set(e, t, pblk + (t - lblk) * PFS_STRS_PER_BLOCK, (lblk + len - t) | uw);
+		else
+			e->e_len = cpu_to_le32((s - lblk) | uw);
+		pfs_ext_dirty(inode, &eb, i);
+		i++;
+	}
+	pfs_ext_release(&eb);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	return err;
+}
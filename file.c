@@ -3,11 +3,74 @@
 #include	"pfs.h"
 
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+#define pfs_lock(inode)		inode_lock(inode)
+#define pfs_unlock(inode)	inode_unlock(inode)
+#else
+#define pfs_lock(inode)		mutex_lock(&(inode)->i_mutex)
+#define pfs_unlock(inode)	mutex_unlock(&(inode)->i_mutex)
+#endif
+
+/*
+ * holes and unwritten blocks are holes, whole unmapped pointer blocks are
+ * stepped over without being read
+ */
+static loff_t
+pfs_seek_hole_data(struct file *file, loff_t offset, int whence)
+{
+	int	err = 0;
+	sector_t block, end;
+	struct pfs_map map;
+	struct inode *inode = file_inode(file);
+
+	pfs_lock(inode);
+	if(offset < 0 || offset >= inode->i_size){
+		err = -ENXIO;
+		goto out;
+	}
+	if(pfs_has_inline(inode)){
+		if(whence == SEEK_HOLE)
+			offset = inode->i_size;
+		goto out;
+	}
+	if(PFS_I(inode)->i_reserved && (err = filemap_write_and_wait(inode->i_mapping)))
+		goto out;
+	end = (inode->i_size + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT;
+	for(block = offset >> PFS_BLOCKSFT; block < end; block += map.m_len){
+		map.m_lblk = block;
+		if((err = pfs_map_lookup(inode, &map)))
+			goto out;
+		if((map.m_pblk && !(map.m_flags & PFS_MAP_UNWRITTEN)) == (whence == SEEK_DATA))
+			break;
+	}
+	if(block >= end && whence == SEEK_DATA)
+		err = -ENXIO;
+	else
+		offset = min_t(loff_t, max_t(loff_t, offset, (loff_t)block << PFS_BLOCKSFT), inode->i_size);
+out:
+	pfs_unlock(inode);
+	if(err)
+		return err;
+	return vfs_setpos(file, offset, inode->i_sb->s_maxbytes);
+}
+
+static loff_t
+pfs_llseek(struct file *file, loff_t offset, int whence)
+{
+	switch(whence){
+	case SEEK_DATA:
+	case SEEK_HOLE:
+		return pfs_seek_hole_data(file, offset, whence);
+	default:
+		return generic_file_llseek(file, offset, whence);
+	}
+}
+
 /*
  * we have mostly NULLs here: the current defaults are ok for the pfs filesystem
  */
 const struct file_operations pfs_file_operations = {
-        .llseek         = generic_file_llseek,
+        .llseek         = pfs_llseek,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
         .read_iter      = generic_file_read_iter,
 #else
@@ -24,6 +87,7 @@ const struct file_operations pfs_file_operations = {
 	.open 		= generic_file_open,
         .fsync          = generic_file_fsync,
         .splice_read    = generic_file_splice_read,
+        .fallocate      = pfs_fallocate,
 };
 
 static int
@@ -47,6 +111,65 @@ pfs_setattr(struct dentry *dentry, struct iattr *attr)
 	return 0;
 }
 
+/*
+ * runs that follow each other on disk are merged into one extent, holes
+ * are skipped a pointer block at a time
+ */
+static int
+pfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	int	err;
+	sector_t block, end;
+	u64	lblk = 0, pblk = 0, size = 0;
+	u32	flags = 0;
+	struct pfs_map map;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	if((err = fiemap_prep(inode, fieinfo, start, &len, FIEMAP_FLAG_SYNC)))
+		return err;
+#else
+	if((err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC)))
+		return err;
+#endif
+	if(PFS_I(inode)->i_reserved && (err = filemap_write_and_wait(inode->i_mapping)))
+		return err;
+	pfs_lock(inode);
+	if(pfs_has_inline(inode)){
+		if(inode->i_size)
+			err = fiemap_fill_next_extent(fieinfo, 0, 0, inode->i_size, 
+				FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_LAST);
+		goto out;
+	}
+	end = min_t(u64, (start + len + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT, PFS_MAXBLOCKS);
+	for(block = start >> PFS_BLOCKSFT; block < end; block += map.m_len){
+		map.m_lblk = block;
+		if((err = pfs_map_lookup(inode, &map)))
+			goto out;
+		if(!map.m_pblk)
+			continue;
+		map.m_len = min_t(sector_t, map.m_len, end - block);
+		if(size && lblk + size == (u64)block << PFS_BLOCKSFT && pblk + size == (u64)map.m_pblk << 9 && 
+			flags == (map.m_flags & PFS_MAP_UNWRITTEN ? FIEMAP_EXTENT_UNWRITTEN : 0)){
+			size += (u64)map.m_len << PFS_BLOCKSFT;
+			continue;
+		}
+		if(size && (err = fiemap_fill_next_extent(fieinfo, lblk, pblk, size, flags)))
+			goto out;
+		lblk = (u64)block << PFS_BLOCKSFT;
+		pblk = (u64)map.m_pblk << 9;
+		size = (u64)map.m_len << PFS_BLOCKSFT;
+		flags = map.m_flags & PFS_MAP_UNWRITTEN ? FIEMAP_EXTENT_UNWRITTEN : 0;
+	}
+	if(size && lblk + size >= (u64)inode->i_size)
+		flags |= FIEMAP_EXTENT_LAST;
+	if(size)
+		err = fiemap_fill_next_extent(fieinfo, lblk, pblk, size, flags);
+out:
+	pfs_unlock(inode);
+	return err < 0 ? err : 0;
+}
+
 const struct inode_operations pfs_file_inode_operations = {
 	.setattr = pfs_setattr,
+	.fiemap	 = pfs_fiemap,
 };
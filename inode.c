@@ -1,9 +1,13 @@
 #include	<linux/fs.h> 
 #include	<linux/namei.h>
+#include	<linux/sched.h>
 #include	<linux/version.h>
 #include	<linux/writeback.h>
 #include	<linux/buffer_head.h>
 #include	<linux/mpage.h>
+#include	<linux/slab.h>
+#include	<linux/highmem.h>
+#include	<linux/pagemap.h>
 #include	"pfs.h"
 
 typedef struct{
@@ -12,6 +16,16 @@ typedef struct{
 	struct buffer_head *bh;
 }Indirect;
 
+/*
+ * blocks freed by truncate and punch go back to the free list
+ * PFS_FREEBATCH at a time under a single s_block
+ */
+typedef struct{
+	int	n;
+	int	max;
+	int64_t	*dno;
+}Freebatch;
+
 static inline int
 pfs_depth(int x)
 {
@@ -22,6 +36,19 @@ pfs_depth(int x)
 	return (x - (int)PFS_IND_BLOCK) / PFS_DIND_BLOCK + 3; 
 }
 
+/*
+ * the number of blocks mapped under a pointer depth levels above the data
+ */
+static sector_t
+pfs_span(int depth)
+{
+	sector_t span = 1;
+
+	while(--depth > 0)
+		span *= PFS_INBLOCKS;
+	return span;
+}
+
 static inline void
 pfs_add_chain(Indirect *p, struct buffer_head *bh, sector_t *v)
 {
@@ -55,135 +82,301 @@ pfs_set(struct inode *inode, void *data)
 static int
 pfs_atomic_alloc(struct inode *inode, Indirect *p)
 {
-	int err = 0;
 	int64_t	dno;
-	struct super_block *sb = inode->i_sb;
-	struct pfs_sb_info *sbi = PFS_SB(sb);
 
-	mutex_lock(&sbi->s_lock);
-	if(!(dno = pfs_alloc(sb, PFS_ALLOC_BLOCK))){ 
-		err = -1;
-		goto out;
-	}
+	if(!(dno = pfs_new_block(inode->i_sb, PFS_I(inode)->i_goal))) 
+		return -1;
+	PFS_I(inode)->i_goal = dno + PFS_STRS_PER_BLOCK;
 	if(p->bh){ 
 		p->key = dno;
 		*(p->p) = cpu_to_le64(dno); 
 		mark_buffer_dirty_inode(p->bh, inode);
 	}else
 		p->key = *(p->p) = dno; 
-	inode->i_blocks++; 
+	pfs_add_blocks(inode, 1);
 	inode->i_ctime = CURRENT_TIME_SEC;
 	mark_inode_dirty(inode); 
-out:
-	mutex_unlock(&sbi->s_lock);
-	return err;
+	return 0;
 }
 
-static int
-pfs_atomic_free(struct inode *inode, Indirect *p)
+static void
+pfs_batch_init(Freebatch *fb, int64_t *stack, int size)
 {
-	int err = 0;
-	struct super_block *sb = inode->i_sb;
-	struct pfs_sb_info *sbi = PFS_SB(sb);
-	
-	mutex_lock(&sbi->s_lock);
-	if(pfs_free(sb, p->key, PFS_ALLOC_BLOCK)){
-		err = -1;
-		goto out;
+	fb->n = 0;
+	if((fb->dno = kmalloc(PFS_FREEBATCH * sizeof(int64_t), GFP_NOFS))){
+		fb->max = PFS_FREEBATCH;
+	}else{
+		fb->dno = stack;
+		fb->max = size;
 	}
-	p->key = *(p->p) = 0; 
-	if(p->bh)
-		mark_buffer_dirty_inode(p->bh, inode);
-	inode->i_blocks--; 
-        inode->i_ctime = CURRENT_TIME_SEC;
+}
+
+static void
+pfs_batch_flush(struct inode *inode, Freebatch *fb)
+{
+	if(!fb->n)
+		return;
+	pfs_free_blocks(inode->i_sb, fb->dno, fb->n);
+	pfs_add_blocks(inode, -fb->n);
+	fb->n = 0;
+}
+
+static void
+pfs_batch_free(struct inode *inode, Freebatch *fb, int64_t *stack)
+{
+	pfs_batch_flush(inode, fb);
+	if(fb->dno != stack)
+		kfree(fb->dno);
+	inode->i_ctime = CURRENT_TIME_SEC;
 	mark_inode_dirty(inode);
-out:
-	mutex_unlock(&sbi->s_lock);
-	return 0;
 }
 
-static int
-pfs_bmap_free(struct inode *inode, Indirect *q, int64_t *offset, int depth, int whole)
+static inline void
+pfs_batch_add(struct inode *inode, Freebatch *fb, int64_t dno)
 {
-	if(--depth){
-		int	i;
-		Indirect chain;
-		struct buffer_head *bh;
+	if(fb->n == fb->max)
+		pfs_batch_flush(inode, fb);
+	fb->dno[fb->n++] = dno & ~PFS_UNWRITTEN;
+}
 
-		if(!q->key) 
-			return 0;
-		if(!(bh = sb_bread(inode->i_sb, q->key / PFS_STRS_PER_BLOCK))) 
-			return -1;
-		if(whole){ 
-			for(i = 0; i < PFS_INBLOCKS; i++){
-				pfs_add_chain(&chain, bh, (int64_t *)bh->b_data + i);
-				pfs_bmap_free(inode, &chain, NULL, depth, 1);
-			}
-			bforget(bh);
-			pfs_atomic_free(inode, q);
-		}else{
-			for(i = offset[0]; i < PFS_INBLOCKS; i++){
-				pfs_add_chain(&chain, bh, (int64_t *)bh->b_data + i);
-				pfs_bmap_free(inode, &chain, i == offset[0] ? offset + 1 : NULL, depth, i == offset[0] ? 0 : 1);
-			}	
-			brelse(bh);
+/*
+ * put the blocks of the subtree under dno, depth levels above the data,
+ * in the batch. the pointer blocks of the next level are read ahead
+ * before they are walked and each one is forgotten once it is done, it
+ * is never read again
+ */
+static void
+pfs_free_tree(struct inode *inode, Freebatch *fb, int64_t dno, int depth)
+{
+	int	i;
+	int64_t	tm, *p;
+	struct buffer_head *bh;
+
+	if(--depth){
+		if(!(bh = sb_bread(inode->i_sb, dno / PFS_STRS_PER_BLOCK))){
+			pr_warn("pfs: device %s: %s: failed to read block %lld of inode %lld\n", 
+				inode->i_sb->s_id, "pfs_free_tree", dno, PFS_I(inode)->i_ino);
+			return;
 		}
-	}else{
-		if(!q->key)
-			return 0;
-		if(whole)
-			return pfs_atomic_free(inode, q);
+		p = (int64_t *)bh->b_data;
+		for(i = 0; depth > 1 && i < PFS_INBLOCKS; i++){
+			if((tm = le64_to_cpu(p[i])))
+				sb_breadahead(inode->i_sb, tm / PFS_STRS_PER_BLOCK);
+		}
+		for(i = 0; i < PFS_INBLOCKS; i++){
+			if((tm = le64_to_cpu(p[i])))
+				pfs_free_tree(inode, fb, tm, depth);
+		}
+		bforget(bh);
 	}
+	pfs_batch_add(inode, fb, dno);
+}
+
+/*
+ * free what q points to from offset on, all of it when whole is set or
+ * offset is at the start of the subtree
+ */
+static int
+pfs_bmap_free(struct inode *inode, Freebatch *fb, Indirect *q, int64_t *offset, int depth, int whole)
+{
+	int	i;
+	Indirect chain;
+	struct buffer_head *bh;
+
+	if(!q->key) 
+		return 0;
+	for(i = 0; !whole && i < depth - 1 && !offset[i]; i++)
+		;
+	if(whole || i == depth - 1){
+		pfs_free_tree(inode, fb, q->key, depth);
+		q->key = *(q->p) = 0; 
+		if(q->bh)
+			mark_buffer_dirty_inode(q->bh, inode);
+		return 0;
+	}
+	if(!(bh = sb_bread(inode->i_sb, q->key / PFS_STRS_PER_BLOCK))) 
+		return -1;
+	for(i = offset[0]; i < PFS_INBLOCKS; i++){
+		pfs_add_chain(&chain, bh, (int64_t *)bh->b_data + i);
+		pfs_bmap_free(inode, fb, &chain, offset + 1, depth - 1, i != offset[0]);
+	}	
+	brelse(bh);
 	return 0;
 }
 
+static inline int64_t
+pfs_get_slot(Indirect *q, int i)
+{
+	return q->bh ? le64_to_cpu(q->p[i]) : q->p[i];
+}
+
+static inline void
+pfs_set_slot(Indirect *q, int i, int64_t dno)
+{
+	q->p[i] = q->bh ? cpu_to_le64(dno) : dno;
+}
+
+/*
+ * the block after the previous one of the file in the same block of
+ * pointers, or after the pointer block itself, or where the inode last
+ * allocated
+ */
 static int64_t
-pfs_bmap_alloc(struct inode *inode, int64_t *offset, int depth)
+pfs_find_goal(struct inode *inode, Indirect *q, int64_t off)
+{
+	int64_t	goal;
+
+	if(off && (goal = pfs_get_slot(q, -1)))
+		return (goal & ~PFS_UNWRITTEN) + PFS_STRS_PER_BLOCK;
+	if(q->bh)
+		return q->bh->b_blocknr * PFS_STRS_PER_BLOCK + PFS_STRS_PER_BLOCK;
+	return PFS_I(inode)->i_goal;
+}
+
+/*
+ * walk down to the last level, allocating the missing indirect blocks on the
+ * way. *qp is left on the last element of the chain, even on failure
+ */
+static int
+pfs_bmap_path(struct inode *inode, int64_t *offset, int depth, Indirect *chain, Indirect **qp)
 {
 	int64_t	tm;
-	Indirect chain[PFS_DEPTH], *q = chain;
+	Indirect *q = chain;
 
 	pfs_add_chain(q, NULL, PFS_I(inode)->i_addr + *offset);
-        if(!(tm = q->key) && pfs_atomic_alloc(inode, q))
-                goto no_block;
+	*qp = q;
         while(--depth){
                 struct buffer_head      *bh;
 
+        	if(!(tm = q->key) && pfs_atomic_alloc(inode, q))
+                	return -ENOSPC;
                 if(!(bh = sb_bread(inode->i_sb, q->key / PFS_STRS_PER_BLOCK)))
-                        goto no_block;
-                if(!tm)
+                        return -EIO;
+                if(!tm){
                         memset(bh->b_data, 0, PFS_BLOCKSIZ);
-                pfs_add_chain(++q, bh, (int64_t *)bh->b_data + *++offset);
-                if(!(tm = q->key) && pfs_atomic_alloc(inode, q))
-                        goto no_block;
+			mark_buffer_dirty_inode(bh, inode);
+		}
+                pfs_add_chain(*qp = ++q, bh, (int64_t *)bh->b_data + *++offset);
         }
+	return 0;
+}
+
+/*
+ * allocate the missing indirect blocks down to the last level, then fill
+ * the unmapped slots of the run starting at the last offset with a single
+ * pfs_alloc_blocks() call (single blocks come from the per-cpu cache).
+ * only the physically contiguous head of the run is kept, the rest goes
+ * back to the allocator. PFS_CREATE_UNWRITTEN allocates unwritten blocks,
+ * PFS_CREATE turns an unwritten run into a written one
+ */
+static int
+pfs_bmap_alloc(struct inode *inode, int64_t *offset, int depth, struct pfs_map *map, int create)
+{
+	int	i, n, lim;
+	int	err;
+	int64_t	tm, goal, dnos[PFS_ALLOCBATCH];
+	struct super_block *sb = inode->i_sb;
+	Indirect chain[PFS_DEPTH], *q;
+
+	if((err = pfs_bmap_path(inode, offset, depth, chain, &q)))
+		goto out;
+	offset += depth - 1;
+	lim = min_t(int64_t, map->m_len, (q->bh ? PFS_INBLOCKS : PFS_D_BLOCK) - *offset);
+	if((tm = q->key)){ 
+		for(n = 1; n < lim && pfs_get_slot(q, n) == tm + n * PFS_STRS_PER_BLOCK; n++)
+			;
+		if((tm & PFS_UNWRITTEN) && create == PFS_CREATE){
+			for(i = 0; i < n; i++)
+				pfs_set_slot(q, i, (tm & ~PFS_UNWRITTEN) + i * PFS_STRS_PER_BLOCK);
+			if(q->bh)
+				mark_buffer_dirty_inode(q->bh, inode);
+			mark_inode_dirty(inode);
+			pfs_mcache_clear(inode);
+			map->m_flags |= PFS_MAP_NEW;
+		}else if(tm & PFS_UNWRITTEN)
+			map->m_flags |= PFS_MAP_UNWRITTEN;
+		map->m_pblk = tm & ~PFS_UNWRITTEN;
+		map->m_len = n;
+		err = 0;
+		goto out;
+	}
+	for(n = 1; n < lim && n < PFS_ALLOCBATCH && !pfs_get_slot(q, n); n++)
+		;
+	goal = pfs_find_goal(inode, q, *offset);
+	if(n == 1) 
+		n = (dnos[0] = pfs_new_block(sb, goal)) ? 1 : 0;
+	else
+		n = pfs_alloc_blocks(sb, goal, n, dnos);
+	if(!n){
+		err = -ENOSPC;
+		goto out;
+	}
+	for(i = 1; i < n && dnos[i] == dnos[0] + i * PFS_STRS_PER_BLOCK; i++)
+		;
+	while(n > i)
+		pfs_free_block(sb, dnos[--n]);
+	for(i = 0; i < n; i++)
+		pfs_set_slot(q, i, create == PFS_CREATE_UNWRITTEN ? dnos[i] | PFS_UNWRITTEN : dnos[i]);
+	if(create == PFS_CREATE_UNWRITTEN)
+		map->m_flags |= PFS_MAP_UNWRITTEN;
+	PFS_I(inode)->i_goal = dnos[n - 1] + PFS_STRS_PER_BLOCK;
+	if(q->bh)
+		mark_buffer_dirty_inode(q->bh, inode);
+	pfs_add_blocks(inode, n);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	map->m_pblk = dnos[0];
+	map->m_len = n;
+	map->m_flags |= PFS_MAP_NEW;
+	err = 0;
+out:
         pfs_free_chain(q, chain);
-        return q->key;
-no_block:
-        pfs_free_chain(q, chain);
-        return 0;
+	return err;
 }
 
-static int64_t
-pfs_bmap(struct inode *inode, int64_t *offset, int depth)
+/*
+ * the run of physically contiguous blocks starting at the last offset, up
+ * to the end of its pointer block. for a hole m_pblk is 0 and m_len runs
+ * to the end of the unmapped subtree and the empty slots after it, found
+ * without reading anything below a missing pointer
+ */
+static int
+pfs_bmap(struct inode *inode, int64_t *offset, int depth, struct pfs_map *map)
 {
+	int	i, k, n, lim;
+	sector_t hole;
 	Indirect chain[PFS_DEPTH], *q = chain;
 
-	pfs_add_chain(q, NULL, PFS_I(inode)->i_addr + *offset);
-	if(!q->key)
-		goto no_block;
-	while(--depth){
+	pfs_add_chain(q, NULL, PFS_I(inode)->i_addr + offset[0]);
+	for(k = 1; q->key && k < depth; k++){
 		struct buffer_head	*bh;
 
-		if(!(bh = sb_bread(inode->i_sb, q->key / PFS_STRS_PER_BLOCK)))
-			goto no_block;
-		pfs_add_chain(++q, bh, (int64_t *)bh->b_data + *++offset);
-		if(!q->key)
-			goto no_block;
+		if(!(bh = sb_bread(inode->i_sb, q->key / PFS_STRS_PER_BLOCK))){
+			pfs_free_chain(q, chain);
+			return -EIO;
+		}
+		pfs_add_chain(++q, bh, (int64_t *)bh->b_data + offset[k]);
 	}
+	if(!q->key)
+		goto no_block;
+	lim = min_t(int64_t, map->m_len, (q->bh ? PFS_INBLOCKS : PFS_D_BLOCK) - offset[depth - 1]);
+	for(n = 1; n < lim && pfs_get_slot(q, n) == q->key + n * PFS_STRS_PER_BLOCK; n++)
+		;
+	if(q->key & PFS_UNWRITTEN)
+		map->m_flags |= PFS_MAP_UNWRITTEN;
+	map->m_pblk = q->key & ~PFS_UNWRITTEN;
+	map->m_len = n;
 	pfs_free_chain(q, chain);
-	return q->key;
+	return 0;
 no_block:
+	k = q - chain;
+	hole = pfs_span(depth - k);
+	for(i = k + 1; i < depth; i++)
+		hole -= offset[i] * pfs_span(depth - i);
+	lim = q->bh ? PFS_INBLOCKS : depth == 1 ? PFS_D_BLOCK : offset[0] + 1;
+	for(i = offset[k] + 1; i < lim && hole < INT_MAX && !pfs_get_slot(q, i - offset[k]); i++)
+		hole += pfs_span(depth - k);
+	map->m_len = min_t(sector_t, hole, INT_MAX);
 	pfs_free_chain(q, chain);
 	return 0;
 }
@@ -223,26 +416,416 @@ pfs_block_to_path(struct inode *inode, sector_t block, int64_t *offsets)
 }
 
 static int
-pfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh, int create)
+pfs_mcache_lookup(struct inode *inode, struct pfs_map *map)
+{
+	int	i, ret = 0;
+	struct pfs_mcache *c = PFS_I(inode)->i_mcache;
+
+	spin_lock(&inode->i_lock);
+	for(i = 0; i < PFS_MCACHESIZ; i++, c++){
+		if(map->m_lblk < c->c_lblk || map->m_lblk >= c->c_lblk + c->c_len)
+			continue;
+		map->m_pblk = c->c_pblk + (map->m_lblk - c->c_lblk) * PFS_STRS_PER_BLOCK;
+		map->m_len = min_t(sector_t, map->m_len, c->c_lblk + c->c_len - map->m_lblk);
+		map->m_flags = c->c_flags;
+		ret = 1;
+		break;
+	}
+	spin_unlock(&inode->i_lock);
+	return ret;
+}
+
+/*
+ * grow the run the new one continues, or replace the oldest one
+ */
+static void
+pfs_mcache_insert(struct inode *inode, struct pfs_map *map)
+{
+	int	i;
+	struct pfs_inode_info *pi = PFS_I(inode);
+	struct pfs_mcache *c = pi->i_mcache;
+
+	spin_lock(&inode->i_lock);
+	for(i = 0; i < PFS_MCACHESIZ; i++, c++){
+		if(c->c_len && c->c_lblk + c->c_len == map->m_lblk && c->c_len <= INT_MAX - map->m_len &&
+			c->c_pblk + (int64_t)c->c_len * PFS_STRS_PER_BLOCK == map->m_pblk &&
+			c->c_flags == (map->m_flags & PFS_MAP_UNWRITTEN)){
+			c->c_len += map->m_len;
+			goto out;
+		}
+	}
+	c = pi->i_mcache + pi->i_mnext;
+	pi->i_mnext = (pi->i_mnext + 1) % PFS_MCACHESIZ;
+	c->c_lblk = map->m_lblk;
+	c->c_pblk = map->m_pblk;
+	c->c_len = map->m_len;
+	c->c_flags = map->m_flags & PFS_MAP_UNWRITTEN;
+out:
+	spin_unlock(&inode->i_lock);
+}
+
+void
+pfs_mcache_clear(struct inode *inode)
+{
+	spin_lock(&inode->i_lock);
+	memset(PFS_I(inode)->i_mcache, 0, sizeof(PFS_I(inode)->i_mcache));
+	PFS_I(inode)->i_mnext = 0;
+	spin_unlock(&inode->i_lock);
+}
+
+static int
+pfs_map_walk(struct inode *inode, struct pfs_map *map, int create)
 {
-	int64_t	dno;
 	int	depth;
 	int64_t	offset[PFS_DEPTH];
 
-	if(unlikely(!(depth = pfs_block_to_path(inode, block, offset)))) 
+	if(unlikely(pfs_has_inline(inode)))
 		return -EIO;
-	if(!create){
-		if(!(dno = pfs_bmap(inode, offset, depth)))
-			return -EIO;
-		goto out;
+	if(pfs_has_extents(inode))
+		return pfs_ext_map_blocks(inode, map, create);
+	if(unlikely(!(depth = pfs_block_to_path(inode, map->m_lblk, offset)))) 
+		return -EIO;
+	if(!create)
+		return pfs_bmap(inode, offset, depth, map);
+	return pfs_bmap_alloc(inode, offset, depth, map, create);
+}
+
+/*
+ * lookups ask the walk for the whole run so that it can be cached, and
+ * carry on past the end of a pointer block or extent while the caller
+ * wants more and the next run follows on disk. the result is trimmed to
+ * what the caller wanted. called with i_mlock held, for writing if create
+ */
+int
+__pfs_map_blocks(struct inode *inode, struct pfs_map *map, int create)
+{
+	int	err, len;
+	struct pfs_map next;
+
+	if(map->m_len < 1)
+		map->m_len = 1;
+	len = map->m_len;
+	map->m_pblk = 0;
+	map->m_flags = 0;
+	map->m_len = create ? len : INT_MAX;
+	if((err = pfs_map_walk(inode, map, create)))
+		return err;
+	if(!map->m_pblk){
+		map->m_len = 0;
+		return 0;
+	}
+	while(!create && map->m_len < len){
+		next.m_lblk = map->m_lblk + map->m_len;
+		next.m_pblk = 0;
+		next.m_flags = 0;
+		next.m_len = INT_MAX - map->m_len;
+		if(pfs_map_walk(inode, &next, 0) || next.m_pblk != map->m_pblk + (int64_t)map->m_len * PFS_STRS_PER_BLOCK ||
+			next.m_flags != map->m_flags)
+			break;
+		map->m_len += next.m_len;
 	}
-	if(!(dno = pfs_bmap_alloc(inode, offset, depth)))
+	pfs_mcache_insert(inode, map);
+	map->m_len = min(map->m_len, len);
+	return 0;
+}
+
+/*
+ * runs found in the cache need no lock. the others are walked with i_mlock
+ * shared, or held exclusively when blocks may be allocated. create is
+ * PFS_CREATE or PFS_CREATE_UNWRITTEN, cached unwritten runs go through the
+ * walk for PFS_CREATE to be written
+ */
+int
+pfs_map_blocks(struct inode *inode, struct pfs_map *map, int create)
+{
+	int	err, len;
+
+	if(map->m_len < 1)
+		map->m_len = 1;
+	len = map->m_len;
+	map->m_pblk = 0;
+	map->m_flags = 0;
+	if(pfs_mcache_lookup(inode, map)){
+		if(!(create == PFS_CREATE && (map->m_flags & PFS_MAP_UNWRITTEN))){
+			pfs_stat_inc(inode->i_sb, st_mhit);
+			return 0;
+		}
+		map->m_len = len;
+	}
+	pfs_stat_inc(inode->i_sb, st_mmiss);
+	if(create){
+		down_write(&PFS_I(inode)->i_mlock);
+		err = __pfs_map_blocks(inode, map, create);
+		up_write(&PFS_I(inode)->i_mlock);
+	}else{
+		down_read(&PFS_I(inode)->i_mlock);
+		err = __pfs_map_blocks(inode, map, create);
+		up_read(&PFS_I(inode)->i_mlock);
+	}
+	return err;
+}
+
+/*
+ * a lookup that leaves holes as they come from the walk, m_pblk 0 and
+ * m_len up to the next block that may be mapped
+ */
+int
+pfs_map_lookup(struct inode *inode, struct pfs_map *map)
+{
+	int	err;
+
+	map->m_len = INT_MAX;
+	map->m_pblk = 0;
+	map->m_flags = 0;
+	if(pfs_mcache_lookup(inode, map))
+		return 0;
+	map->m_len = INT_MAX;
+	down_read(&PFS_I(inode)->i_mlock);
+	err = pfs_map_walk(inode, map, 0);
+	up_read(&PFS_I(inode)->i_mlock);
+	return err;
+}
+
+/*
+ * point up to count blocks of the indirect map from block on at the run
+ * starting at dno (or clear them if dno is 0), stopping at the end of the
+ * pointer block. returns the number of blocks set
+ */
+int
+pfs_set_blocks(struct inode *inode, sector_t block, int64_t dno, int count)
+{
+	int	i, n, err, depth;
+	int64_t	offset[PFS_DEPTH];
+	Indirect chain[PFS_DEPTH], *q;
+
+	if(unlikely(!(depth = pfs_block_to_path(inode, block, offset)))) 
 		return -EIO;
-out:
-	map_bh(bh, inode->i_sb, dno / PFS_STRS_PER_BLOCK);
+	if(!(err = pfs_bmap_path(inode, offset, depth, chain, &q))){
+		n = min_t(int64_t, count, (q->bh ? PFS_INBLOCKS : PFS_D_BLOCK) - offset[depth - 1]);
+		for(i = 0; i < n; i++)
+			pfs_set_slot(q, i, dno ? dno + i * PFS_STRS_PER_BLOCK : 0);
+		if(q->bh)
+			mark_buffer_dirty_inode(q->bh, inode);
+		else
+			mark_inode_dirty(inode);
+	}
+	pfs_free_chain(q, chain);
+	return err ? err : n;
+}
+
+/*
+ * the wbc of the pfs_writepages this task is running on inode, if any
+ */
+static struct writeback_control *
+pfs_writeback_wbc(struct inode *inode)
+{
+	struct writeback_control *wbc;
+
+	spin_lock(&inode->i_lock);
+	wbc = PFS_I(inode)->i_wbtask == current ? PFS_I(inode)->i_wbc : NULL;
+	spin_unlock(&inode->i_lock);
+	return wbc;
+}
+
+/*
+ * the last page the running writeback may write from index on, as far as
+ * its range and, for background writeback, nr_to_write go
+ */
+static pgoff_t
+pfs_writeback_last(struct writeback_control *wbc, pgoff_t index)
+{
+	pgoff_t	last = wbc->range_cyclic ? (pgoff_t)-1 : wbc->range_end >> PAGE_SHIFT;
+
+	if(wbc->sync_mode == WB_SYNC_NONE && last - index >= (pgoff_t)max(wbc->nr_to_write, 1L))
+		last = index + max(wbc->nr_to_write, 1L) - 1;
+	return last;
+}
+
+/*
+ * number of delayed blocks from bh on, looking ahead into the next pages
+ * of the file so that writeback allocates them as one run. only pages the
+ * running pfs_writepages is going to write are taken, a block mapped for
+ * a page left dirty would show stale data after a crash. a page that is
+ * locked by someone else, clean or not wholly delayed ends the run, so
+ * does page last. the pages taken are handed back locked in pages, np of
+ * them
+ */
+static int
+pfs_delayed_run(struct inode *inode, struct buffer_head *bh, pgoff_t last, struct page **pages, int *np)
+{
+	int	n = 0, full = 1;
+	pgoff_t	index = bh->b_page->index;
+	struct page *page;
+	struct buffer_head *head = page_buffers(bh->b_page);
+
+	*np = 0;
+	do{
+		if(!buffer_delay(bh))
+			return max(n, 1);
+		n++;
+	}while((bh = bh->b_this_page) != head);
+	while(full && n < PFS_ALLOCBATCH && index < last && (page = find_get_page(inode->i_mapping, ++index))){
+		if((full = PageDirty(page) && !PageWriteback(page) && trylock_page(page))){
+			if((full = page->mapping == inode->i_mapping && PageDirty(page) && page_has_buffers(page))){
+				bh = head = page_buffers(page);
+				if(buffer_delay(bh))
+					pages[(*np)++] = page;
+				do{
+					if(!(full = buffer_delay(bh)))
+						break;
+					n++;
+				}while((bh = bh->b_this_page) != head);
+			}
+			if(*np && pages[*np - 1] == page)	/* kept locked for the caller */
+				continue;
+			unlock_page(page);
+		}
+		put_page(page);
+	}
+	return min(n, PFS_ALLOCBATCH);
+}
+
+/*
+ * map the delayed buffers of the page from bh on that the run in map
+ * covers, done blocks of it being given out already. returns the new done
+ */
+static int
+pfs_map_delayed(struct inode *inode, struct buffer_head *bh, struct pfs_map *map, int done)
+{
+	struct buffer_head *head = page_buffers(bh->b_page);
+
+	do{
+		if(done >= map->m_len || !buffer_delay(bh))
+			break;
+		map_bh(bh, inode->i_sb, (map->m_pblk + (int64_t)done++ * PFS_STRS_PER_BLOCK) / PFS_STRS_PER_BLOCK);
+		clear_buffer_delay(bh);
+	}while((bh = bh->b_this_page) != head);
+	return done;
+}
+
+/*
+ * allocate the hole at map->m_lblk, whose delayed buffer is bh, together
+ * with the delayed blocks that follow it. every buffer the run covers is
+ * mapped and loses BH_Delay, and their reservation goes back at once:
+ * mpage then finds the following pages mapped, and the blocks are not
+ * counted as both allocated and reserved until writeback gets to them
+ */
+static int
+pfs_alloc_delayed(struct inode *inode, struct buffer_head *bh, pgoff_t last, struct pfs_map *map)
+{
+	int	i, n, np, err;
+	struct page *pages[PFS_ALLOCBATCH];
+
+	map->m_len = pfs_delayed_run(inode, bh, last, pages, &np);
+	if(!(err = pfs_map_blocks(inode, map, PFS_CREATE))){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+		clean_bdev_aliases(inode->i_sb->s_bdev, map->m_pblk / PFS_STRS_PER_BLOCK, map->m_len);
+#else
+		for(i = 0; i < map->m_len; i++)
+			unmap_underlying_metadata(inode->i_sb->s_bdev, map->m_pblk / PFS_STRS_PER_BLOCK + i);
+#endif
+		n = pfs_map_delayed(inode, bh, map, 0);
+		for(i = 0; i < np; i++)
+			n = pfs_map_delayed(inode, page_buffers(pages[i]), map, n);
+		pfs_release_blocks(inode, n);
+	}
+	for(i = 0; i < np; i++){
+		unlock_page(pages[i]);
+		put_page(pages[i]);
+	}
+	return err;
+}
+
+/*
+ * a delayed buffer reaching here is being written back: its block is
+ * allocated together with the delayed blocks that follow it, the later
+ * buffers then find theirs already mapped
+ */
+static int
+pfs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh, int create)
+{
+	int	err, len;
+	struct pfs_map map;
+	struct writeback_control *wbc;
+
+	if(buffer_delay(bh))	/* not mapped, whatever b_blocknr says */
+		clear_buffer_mapped(bh);
+	map.m_lblk = block;
+	map.m_len = len = min_t(size_t, bh->b_size >> PFS_BLOCKSFT, INT_MAX);
+	if(create && buffer_delay(bh)){
+		if((err = pfs_map_blocks(inode, &map, 0)))
+			return err;
+		if(!map.m_len){
+			wbc = pfs_writeback_wbc(inode);
+			err = pfs_alloc_delayed(inode, bh, wbc ? pfs_writeback_last(wbc, bh->b_page->index) : bh->b_page->index, &map);
+		}else if(!(map.m_flags & PFS_MAP_UNWRITTEN) || !(err = pfs_map_blocks(inode, &map, PFS_CREATE))){
+			pfs_release_blocks(inode, len);
+			clear_buffer_delay(bh);
+		}
+		if(err)
+			return err;
+		map.m_len = min(map.m_len, len);
+	}else if((err = pfs_map_blocks(inode, &map, create)))
+		return err;
+	if(!map.m_len || (map.m_flags & PFS_MAP_UNWRITTEN))	/* reads as zeroes */
+		return 0;
+	map_bh(bh, inode->i_sb, map.m_pblk / PFS_STRS_PER_BLOCK);
+	bh->b_size = (size_t)map.m_len << PFS_BLOCKSFT;
+	if(map.m_flags & PFS_MAP_NEW)
+		set_buffer_new(bh);
 	return 0;
 }
 
+/*
+ * get_block of buffered writes to regular files: holes only get a
+ * reservation and a delayed buffer, the blocks come at writeback. so do
+ * unwritten blocks, writeback then marks them written. a new buffer must
+ * look mapped to __block_write_begin, which cleans the bdev alias of its
+ * block, so it is mapped to PFS_DELAY_BLOCK until pfs_unmap_delayed()
+ */
+static int
+pfs_get_block_delay(struct inode *inode, sector_t block, struct buffer_head *bh, int create)
+{
+	int	err;
+	struct pfs_map map;
+
+	map.m_lblk = block;
+	map.m_len = 1;
+	if((err = pfs_map_blocks(inode, &map, 0)))
+		return err;
+	if(map.m_len && !(map.m_flags & PFS_MAP_UNWRITTEN)){
+		map_bh(bh, inode->i_sb, map.m_pblk / PFS_STRS_PER_BLOCK);
+		return 0;
+	}
+	if(!buffer_delay(bh) && (err = pfs_reserve_blocks(inode, 1)))
+		return err;
+	map_bh(bh, inode->i_sb, PFS_DELAY_BLOCK);
+	if(buffer_delay(bh))
+		return 0;
+	set_buffer_new(bh);
+	set_buffer_delay(bh);
+	return 0;
+}
+
+/*
+ * once write_begin is done with the page its delayed buffers go back to
+ * unmapped, so that writeback (mpage included) asks pfs_get_block for
+ * their blocks instead of writing to PFS_DELAY_BLOCK
+ */
+static void
+pfs_unmap_delayed(struct page *page)
+{
+	struct buffer_head *bh, *head;
+
+	if(!page_has_buffers(page))
+		return;
+	bh = head = page_buffers(page);
+	do{
+		if(buffer_delay(bh))
+			clear_buffer_mapped(bh);
+	}while((bh = bh->b_this_page) != head);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0) 
 static void *
 pfs_follow_link(struct dentry *dentry, struct nameidata *nd)
@@ -310,9 +893,14 @@ pfs_update_inode(struct inode *inode, struct writeback_control *wbc)
         ip->i_atime = cpu_to_le64(inode->i_atime.tv_sec);
         ip->i_mtime = cpu_to_le64(inode->i_mtime.tv_sec);
         ip->i_ctime = cpu_to_le64(inode->i_ctime.tv_sec);
+	ip->i_esiz = cpu_to_le32(PFS_I(inode)->i_esiz);
+	ip->i_dents = cpu_to_le64(PFS_I(inode)->i_dents);
+	ip->i_dgen = cpu_to_le32(PFS_I(inode)->i_dgen);
+	for(i = 0; i < PFS_NEXT; i++)
+		ip->i_ext[i] = cpu_to_le64(PFS_I(inode)->i_ext[i]);
         if(S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode)){
                 ip->i_addr[0] = (int64_t)cpu_to_le32(new_encode_dev(inode->i_rdev));
-        }else if(S_ISLNK(inode->i_mode) && !inode->i_blocks){ 
+        }else if((S_ISLNK(inode->i_mode) && !inode->i_blocks) || pfs_has_extents(inode) || pfs_has_inline(inode)){ 
 		memmove(ip->i_addr, PFS_I(inode)->i_addr, sizeof(ip->i_addr)); 
 	}else{
                 for(i = 0; i < PFS_NADDR; i++)
@@ -332,37 +920,224 @@ pfs_update_inode(struct inode *inode, struct writeback_control *wbc)
         return 0;
 }
 
-static void
-__pfs_truncate_blocks(struct inode *inode)
+void
+pfs_truncate_bmap(struct inode *inode, sector_t block)
 {
 	int	i;
 	Indirect chain;
-	int64_t offset[PFS_DEPTH];
+	Freebatch fb;
+	int64_t offset[PFS_DEPTH], stack[PFS_DEPTH * 4];
 
-        if(unlikely(!pfs_block_to_path(inode, (inode->i_size + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT, offset))) 
+        if(unlikely(!pfs_block_to_path(inode, block, offset))) 
                 return;
+	pfs_batch_init(&fb, stack, ARRAY_SIZE(stack));
 	for(i = offset[0]; i < PFS_NADDR; i++){
 		pfs_add_chain(&chain, NULL, PFS_I(inode)->i_addr + i);
-		if(i < PFS_D_BLOCK){ 
-			pfs_bmap_free(inode, &chain, NULL, 1, 1);
-		}else 
-			pfs_bmap_free(inode, &chain, i == offset[0] ? offset + 1 : NULL, pfs_depth(i), i == offset[0] ? 0 : 1);
+		pfs_bmap_free(inode, &fb, &chain, offset + 1, pfs_depth(i), i != offset[0]);
 	}
+	pfs_batch_free(inode, &fb, stack);
+}
+
+static void
+__pfs_truncate_blocks(struct inode *inode)
+{
+	sector_t block = (inode->i_size + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT;
+
+	down_write(&PFS_I(inode)->i_mlock);
+	pfs_mcache_clear(inode);
+	if(pfs_has_inline(inode))
+		memset((char *)PFS_I(inode)->i_addr + inode->i_size, 0, PFS_INLINE_SIZE - inode->i_size);
+	else if(pfs_has_extents(inode))
+		pfs_ext_truncate(inode, block);
+	else
+		pfs_truncate_bmap(inode, block);
+	up_write(&PFS_I(inode)->i_mlock);
 	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
 	mark_inode_dirty(inode);
 }
 
+/*
+ * free the blocks of [start, end) under q, which maps the logical blocks
+ * from base on. subtrees wholly inside the range go to pfs_bmap_free
+ */
+static int
+pfs_bmap_punch(struct inode *inode, Freebatch *fb, Indirect *q, int depth, sector_t base, sector_t start, sector_t end)
+{
+	int	i;
+	sector_t span = pfs_span(depth);
+	Indirect chain;
+	struct buffer_head *bh;
+
+	if(!q->key || base >= end || base + span <= start)
+		return 0;
+	if(base >= start && base + span <= end)
+		return pfs_bmap_free(inode, fb, q, NULL, depth, 1);
+	span /= PFS_INBLOCKS;
+	if(!(bh = sb_bread(inode->i_sb, q->key / PFS_STRS_PER_BLOCK)))
+		return -EIO;
+	for(i = base < start ? (start - base) / span : 0; i < PFS_INBLOCKS && base + i * span < end; i++){
+		pfs_add_chain(&chain, bh, (int64_t *)bh->b_data + i);
+		pfs_bmap_punch(inode, fb, &chain, depth - 1, base + i * span, start, end);
+	}
+	brelse(bh);
+	return 0;
+}
+
+/*
+ * an extent split that doesn't fit in the table turns the file over to
+ * the indirect map, which then punches the rest
+ */
+static int
+pfs_punch_blocks(struct inode *inode, sector_t start, sector_t end)
+{
+	int	i, err = 0;
+	sector_t base = 0;
+	Indirect chain;
+	Freebatch fb;
+	int64_t	stack[PFS_DEPTH * 4];
+
+	if(pfs_has_extents(inode) && (err = pfs_ext_punch(inode, start, end)))
+		return err;
+	if(pfs_has_extents(inode))
+		return 0;
+	pfs_batch_init(&fb, stack, ARRAY_SIZE(stack));
+	for(i = 0; i < PFS_NADDR && base < end && !err; i++){
+		pfs_add_chain(&chain, NULL, PFS_I(inode)->i_addr + i);
+		err = pfs_bmap_punch(inode, &fb, &chain, pfs_depth(i), base, start, end);
+		base += pfs_span(pfs_depth(i));
+	}
+	pfs_batch_free(inode, &fb, stack);
+	return err;
+}
+
+/*
+ * zero [from, to) within one block through the page cache. holes and
+ * unwritten blocks read as zeroes already
+ */
+static int
+pfs_zero_partial(struct inode *inode, loff_t from, loff_t to)
+{
+	int	err;
+	void	*fsdata = NULL;
+	struct page *page;
+	struct pfs_map map;
+
+	if((to = min(to, i_size_read(inode))) <= from)
+		return 0;
+	map.m_lblk = from >> PFS_BLOCKSFT;
+	map.m_len = 1;
+	if((err = pfs_map_blocks(inode, &map, 0)))
+		return err;
+	if(!map.m_pblk || map.m_flags & PFS_MAP_UNWRITTEN)
+		return 0;
+	if((err = block_write_begin(inode->i_mapping, from, to - from, 0, &page, pfs_get_block)))
+		return err;
+	zero_user(page, from & ~PAGE_MASK, to - from);
+	generic_write_end(NULL, inode->i_mapping, from, to - from, to - from, page, fsdata);
+	return 0;
+}
+
+static int
+pfs_punch_hole(struct inode *inode, loff_t offset, loff_t len)
+{
+	int	err;
+	loff_t	end = offset + len;
+	sector_t start = (offset + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT, stop = end >> PFS_BLOCKSFT;
+
+	if((err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1)))
+		return err;
+	if(start > stop)
+		return pfs_zero_partial(inode, offset, end);
+	if((err = pfs_zero_partial(inode, offset, (loff_t)start << PFS_BLOCKSFT)) || 
+		(err = pfs_zero_partial(inode, (loff_t)stop << PFS_BLOCKSFT, end)))
+		return err;
+	if(start == stop)
+		return 0;
+	truncate_pagecache_range(inode, (loff_t)start << PFS_BLOCKSFT, ((loff_t)stop << PFS_BLOCKSFT) - 1);
+	down_write(&PFS_I(inode)->i_mlock);
+	pfs_mcache_clear(inode);
+	err = pfs_punch_blocks(inode, start, stop);
+	up_write(&PFS_I(inode)->i_mlock);
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	return err;
+}
+
+/*
+ * allocate the holes of the range as unwritten blocks, which read as
+ * zeroes until written
+ */
+static int
+pfs_prealloc(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	int	err = 0;
+	loff_t	size;
+	sector_t block = offset >> PFS_BLOCKSFT, end = (offset + len + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT;
+	struct pfs_map map;
+
+	while(block < end){
+		map.m_lblk = block;
+		map.m_len = min_t(sector_t, end - block, INT_MAX);
+		if((err = pfs_map_blocks(inode, &map, PFS_CREATE_UNWRITTEN)))
+			break;
+		block += map.m_len;
+	}
+	size = min(offset + len, (loff_t)block << PFS_BLOCKSFT);
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && size > inode->i_size)
+		i_size_write(inode, size);
+	inode->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(inode);
+	return err;
+}
+
+long
+pfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	long	err;
+	struct inode *inode = file_inode(file);
+
+	if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+		return -EOPNOTSUPP;
+	if(!S_ISREG(inode->i_mode))
+		return -EOPNOTSUPP;
+	if(!(mode & FALLOC_FL_PUNCH_HOLE) && !pfs_has_feature(inode->i_sb, PFS_FEATURE_UNWRITTEN))
+		return -EOPNOTSUPP;	/* unwritten blocks would read as garbage to older drivers */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	inode_lock(inode);
+#else
+	mutex_lock(&inode->i_mutex);
+#endif
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && (err = inode_newsize_ok(inode, offset + len)))
+		goto out;
+	if(pfs_has_inline(inode) && (err = pfs_inline_convert(inode)))
+		goto out;
+	inode_dio_wait(inode);
+	if(mode & FALLOC_FL_PUNCH_HOLE){
+		err = pfs_punch_hole(inode, offset, len);
+		goto out;
+	}
+	if(mode & FALLOC_FL_ZERO_RANGE && (err = pfs_punch_hole(inode, offset, len)))
+		goto out;
+	err = pfs_prealloc(inode, mode, offset, len);
+out:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	inode_unlock(inode);
+#else
+	mutex_unlock(&inode->i_mutex);
+#endif
+	return err;
+}
+
 int64_t
 pfs_get_block_number(struct inode *inode, sector_t block, int create)
 {
-	int	depth;
-        int64_t offset[PFS_DEPTH];
+	struct pfs_map map;
 
-        if(unlikely(!(depth = pfs_block_to_path(inode, block, offset)))) 
+	map.m_lblk = block;
+	map.m_len = 1;
+	if(pfs_map_blocks(inode, &map, create))
 		return 0;
-        if(!create)
-		return pfs_bmap(inode, offset, depth);
-	return pfs_bmap_alloc(inode, offset, depth);
+	return map.m_pblk;
 }
 
 int
@@ -376,6 +1151,15 @@ pfs_truncate(struct inode *inode, int64_t size)
 		return -EINVAL;
         if(IS_APPEND(inode) || IS_IMMUTABLE(inode))
                 return -EPERM;
+	if(pfs_has_inline(inode) && size > PFS_INLINE_SIZE && (err = pfs_inline_convert(inode)))
+		return err;
+	if(pfs_has_inline(inode)){
+		truncate_setsize(inode, size);
+		__pfs_truncate_blocks(inode);
+		return 0;
+	}
+	if(PFS_I(inode)->i_reserved)	/* block_truncate_page can't zero a delayed block */
+		filemap_write_and_wait_range(inode->i_mapping, size, size | (PFS_BLOCKSIZ - 1));
 	if((err = block_truncate_page(inode->i_mapping, size, pfs_get_block)))
 		return err;
 	truncate_setsize(inode, size);
@@ -423,7 +1207,17 @@ pfs_iget(struct super_block *sb, int64_t ino)
 	inode->i_ctime.tv_sec = le64_to_cpu(ip->i_ctime);
 	inode->i_mtime.tv_sec = le64_to_cpu(ip->i_mtime);
 	inode->i_atime.tv_nsec = inode->i_ctime.tv_nsec = inode->i_mtime.tv_nsec = 0;	
-	if(!(S_ISLNK(inode->i_mode) && !inode->i_blocks)){
+	PFS_I(inode)->i_goal = 0;
+	PFS_I(inode)->i_reserved = 0;
+	PFS_I(inode)->i_esiz = 0;
+	PFS_I(inode)->i_dents = S_ISDIR(inode->i_mode) ? le64_to_cpu(ip->i_dents) : 0;
+	PFS_I(inode)->i_dgen = S_ISDIR(inode->i_mode) ? le32_to_cpu(ip->i_dgen) : 0;
+	pfs_mcache_clear(inode);
+	if(pfs_has_feature(sb, PFS_FEATURE_EXTENT | PFS_FEATURE_INLINE) && S_ISREG(inode->i_mode))
+		PFS_I(inode)->i_esiz = le32_to_cpu(ip->i_esiz);
+	for(i = 0; i < PFS_NEXT; i++)
+		PFS_I(inode)->i_ext[i] = pfs_has_extents(inode) ? le64_to_cpu(ip->i_ext[i]) : 0;
+	if(!(S_ISLNK(inode->i_mode) && !inode->i_blocks) && !pfs_has_extents(inode) && !pfs_has_inline(inode)){
 		for(i = 0; i < PFS_NADDR; i++)
 			PFS_I(inode)->i_addr[i] = le64_to_cpu(ip->i_addr[i]);
 	}else 
@@ -440,9 +1234,9 @@ pfs_free_inode(struct inode *inode)
 	int	err;
 	struct pfs_sb_info *sbi = PFS_SB(inode->i_sb);
 
-	mutex_lock(&sbi->s_lock);
+	mutex_lock(&sbi->s_ilock);
         err = pfs_free(inode->i_sb, PFS_I(inode)->i_ino, PFS_ALLOC_INODE);
-	mutex_unlock(&sbi->s_lock);
+	mutex_unlock(&sbi->s_ilock);
 	return err;
 }
 
@@ -455,23 +1249,36 @@ pfs_new_inode(struct inode *dir, umode_t mode)
 
 	if(!(inode = new_inode(dir->i_sb)))		
 		return ERR_PTR(-ENOMEM);
-	mutex_lock(&sbi->s_lock);
-	if(!(ino = pfs_alloc(dir->i_sb, PFS_ALLOC_INODE))) 
+	mutex_lock(&sbi->s_ilock);
+	ino = pfs_alloc(dir->i_sb, PFS_ALLOC_INODE);
+	mutex_unlock(&sbi->s_ilock);
+	if(!ino) 
 		goto err;
 	inode_init_owner(inode, dir, mode); 
 	inode->i_blocks = 0;
 	pfs_set(inode, &ino);
 	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
 	memset(PFS_I(inode)->i_addr, 0, sizeof(PFS_I(inode)->i_addr)); 
+	memset(PFS_I(inode)->i_ext, 0, sizeof(PFS_I(inode)->i_ext)); 
+	PFS_I(inode)->i_reserved = 0;
+	PFS_I(inode)->i_esiz = 0;
+	PFS_I(inode)->i_dents = 0;
+	PFS_I(inode)->i_dgen = pfs_crashes(dir->i_sb);
+	pfs_mcache_clear(inode);
+	PFS_I(inode)->i_goal = PFS_I(dir)->i_addr[0]; 
+	if(pfs_has_feature(dir->i_sb, PFS_FEATURE_INLINE) && S_ISREG(mode))
+		PFS_I(inode)->i_esiz = PFS_INLINE_FL;
+	else if(pfs_has_feature(dir->i_sb, PFS_FEATURE_EXTENT) && S_ISREG(mode))
+		PFS_I(inode)->i_esiz = PFS_EXT_FL;
 	if(insert_inode_locked4(inode, inode->i_ino, pfs_test, &ino) < 0){ 
+		mutex_lock(&sbi->s_ilock);
 		pfs_free(dir->i_sb, ino, PFS_ALLOC_INODE); 
+		mutex_unlock(&sbi->s_ilock);
 		goto err;
 	}
 	mark_inode_dirty(inode);
-	mutex_unlock(&sbi->s_lock);
 	return inode;
 err:
-	mutex_unlock(&sbi->s_lock);
 	make_bad_inode(inode);
 	iput(inode);
 	return ERR_PTR(-EIO);	
@@ -491,14 +1298,25 @@ pfs_evict_inode(struct inode *inode)
 #else
 	truncate_inode_pages(&inode->i_data, 0);
 #endif
-	if(!inode->i_nlink){
+	if(PFS_I(inode)->i_reserved){
+		pr_warn("pfs: device %s: %s: inode %lld still holds %lld reserved blocks\n", 
+			inode->i_sb->s_id, "pfs_evict_inode", PFS_I(inode)->i_ino, PFS_I(inode)->i_reserved);
+		pfs_release_blocks(inode, PFS_I(inode)->i_reserved);
+	}
+	if(S_ISDIR(inode->i_mode))
+		pfs_dir_release(inode);
+	if(!inode->i_nlink && !PFS_I(inode)->i_orphan && inode->i_blocks >= PFS_ORPHAN_BLOCKS && !pfs_orphan_add(inode))
+		PFS_I(inode)->i_orphan = 1;
+	if(!inode->i_nlink && !PFS_I(inode)->i_orphan){
 		inode->i_size = 0;
 		if(inode->i_blocks) 
 			pfs_truncate_blocks(inode);
 	}
+	if(S_ISDIR(inode->i_mode))
+		pfs_dircache_drop(inode);
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
-	if(!inode->i_nlink)
+	if(!inode->i_nlink && !PFS_I(inode)->i_orphan)
 		pfs_free_inode(inode);
 }
 
@@ -513,16 +1331,191 @@ pfs_write_failed(struct address_space *mapping, loff_t to)
         }
 }
 
+/*
+ * an inline file has its data in i_addr, up to PFS_INLINE_SIZE bytes. it
+ * goes through the page cache like any other, page 0 is filled from and
+ * written back to i_addr and never gets buffers
+ */
+static void
+pfs_inline_fill(struct inode *inode, struct page *page)
+{
+	char	*kaddr = kmap_atomic(page);
+	loff_t	size = page->index ? 0 : min_t(loff_t, i_size_read(inode), PFS_INLINE_SIZE);
+
+	memcpy(kaddr, PFS_I(inode)->i_addr, size);
+	memset(kaddr + size, 0, PAGE_SIZE - size);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr);
+	SetPageUptodate(page);
+}
+
+/*
+ * move the data out to block 0 through the page cache, the block is
+ * allocated when the page is written back. the caller holds i_mutex
+ */
+int
+pfs_inline_convert(struct inode *inode)
+{
+	int	err = 0;
+	char	*kaddr;
+	struct page *page = NULL;
+	loff_t	size = inode->i_size;
+
+	if(size && !(page = grab_cache_page(inode->i_mapping, 0)))
+		return -ENOMEM;
+	if(page && !PageUptodate(page))
+		pfs_inline_fill(inode, page);
+	down_write(&PFS_I(inode)->i_mlock);
+	PFS_I(inode)->i_esiz = pfs_has_feature(inode->i_sb, PFS_FEATURE_EXTENT) ? PFS_EXT_FL : 0;
+	memset(PFS_I(inode)->i_addr, 0, sizeof(PFS_I(inode)->i_addr));
+	up_write(&PFS_I(inode)->i_mlock);
+	if(page && !(err = __block_write_begin(page, 0, size, pfs_get_block_delay)))
+		block_commit_write(page, 0, size);
+	if(page)
+		pfs_unmap_delayed(page);
+	if(err){
+		down_write(&PFS_I(inode)->i_mlock);
+		kaddr = kmap_atomic(page);
+		memcpy(PFS_I(inode)->i_addr, kaddr, size);
+		kunmap_atomic(kaddr);
+		PFS_I(inode)->i_esiz = PFS_INLINE_FL;
+		up_write(&PFS_I(inode)->i_mlock);
+	}
+	if(page){
+		unlock_page(page);
+		put_page(page);
+	}
+	mark_inode_dirty(inode);
+	return err;
+}
+
 static int 
 pfs_readpage(struct file *file, struct page *page)
 {
-        return block_read_full_page(page, pfs_get_block);
+	if(pfs_has_inline(page->mapping->host)){
+		pfs_inline_fill(page->mapping->host, page);
+		unlock_page(page);
+		return 0;
+	}
+        return mpage_readpage(page, pfs_get_block);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+static void
+pfs_readahead(struct readahead_control *rac)
+{
+	if(!pfs_has_inline(rac->mapping->host))	/* pages left over go through pfs_readpage */
+		mpage_readahead(rac, pfs_get_block);
+}
+#else
+static int
+pfs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages)
+{
+	if(pfs_has_inline(mapping->host))	/* pages left over go through pfs_readpage */
+		return 0;
+	return mpage_readpages(mapping, pages, nr_pages, pfs_get_block);
 }
+#endif
 
 static int
 pfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-	return block_write_full_page(page, pfs_get_block, wbc);
+	char	*kaddr;
+	struct inode *inode = page->mapping->host;
+
+	if(!pfs_has_inline(inode)){
+		pfs_stat_inc(inode->i_sb, st_wbsingle);
+		return block_write_full_page(page, pfs_get_block, wbc);
+	}
+	if(!page->index){	/* dirtied through mmap */
+		kaddr = kmap_atomic(page);
+		memcpy(PFS_I(inode)->i_addr, kaddr, min_t(loff_t, i_size_read(inode), PFS_INLINE_SIZE));
+		kunmap_atomic(kaddr);
+		mark_inode_dirty(inode);
+	}
+	unlock_page(page);
+	return 0;
+}
+
+/*
+ * allocate the delayed runs of the dirty pages the running writeback is
+ * going to write before mpage_writepages sees them. mpage sends a page
+ * with a dirty unmapped buffer alone through pfs_writepage, while pages
+ * mapped here that follow each other on disk share its bios. pages locked
+ * by someone else, and those past the wrap of a cyclic pass, are left to
+ * pfs_get_block
+ */
+static void
+pfs_writeback_delayed(struct address_space *mapping, struct writeback_control *wbc)
+{
+	int	i, n;
+	pgoff_t	index, last;
+	sector_t block;
+	struct page *pages[PFS_PVECSIZ];
+	struct buffer_head *bh, *head;
+	struct pfs_map map;
+	struct inode *inode = mapping->host;
+
+	index = wbc->range_cyclic ? mapping->writeback_index : wbc->range_start >> PAGE_SHIFT;
+	last = pfs_writeback_last(wbc, index);
+	while(index <= last && PFS_I(inode)->i_reserved){
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+		if(!(n = find_get_pages_range_tag(mapping, &index, last, PAGECACHE_TAG_DIRTY, PFS_PVECSIZ, pages)))
+#else
+		if(!(n = find_get_pages_tag(mapping, &index, PAGECACHE_TAG_DIRTY, PFS_PVECSIZ, pages)))
+#endif
+			break;
+		for(i = 0; i < n; i++){
+			if(pages[i]->index <= last && trylock_page(pages[i])){
+				if(pages[i]->mapping == mapping && PageDirty(pages[i]) && !PageWriteback(pages[i]) &&
+					page_has_buffers(pages[i])){
+					bh = head = page_buffers(pages[i]);
+					block = (sector_t)pages[i]->index << (PAGE_SHIFT - PFS_BLOCKSFT);
+					while(!buffer_delay(bh) && (bh = bh->b_this_page) != head)
+						block++;
+					map.m_lblk = block;
+					map.m_len = 1;
+					if(buffer_delay(bh) && !pfs_map_blocks(inode, &map, 0) && !map.m_len)
+						pfs_alloc_delayed(inode, bh, last, &map);	/* on failure pfs_get_block tries again */
+				}
+				unlock_page(pages[i]);
+			}
+			put_page(pages[i]);
+		}
+	}
+}
+
+/*
+ * pages whose blocks follow each other on disk go out in one bio, the
+ * others fall back to pfs_writepage. delayed pages are mapped first so
+ * that they do too
+ */
+static int
+pfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+	int	err, own;
+	long	nr = wbc->nr_to_write;
+	struct inode *inode = mapping->host;
+
+	if(pfs_has_inline(inode))
+		return generic_writepages(mapping, wbc);
+	spin_lock(&inode->i_lock);
+	if((own = !PFS_I(inode)->i_wbtask)){
+		PFS_I(inode)->i_wbtask = current;
+		PFS_I(inode)->i_wbc = wbc;
+	}
+	spin_unlock(&inode->i_lock);
+	if(own && PFS_I(inode)->i_reserved)
+		pfs_writeback_delayed(mapping, wbc);
+	err = mpage_writepages(mapping, wbc, pfs_get_block);
+	pfs_stat_add(inode->i_sb, st_wbpages, nr - wbc->nr_to_write);
+	if(own){
+		spin_lock(&inode->i_lock);
+		PFS_I(inode)->i_wbtask = NULL;
+		PFS_I(inode)->i_wbc = NULL;
+		spin_unlock(&inode->i_lock);
+	}
+	return err;
 }
 
 static int
@@ -531,22 +1524,155 @@ pfs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, un
 {
         int ret;
 
-        ret = block_write_begin(mapping, pos, len, flags, pagep, pfs_get_block);
+	if(pfs_has_inline(mapping->host) && pos + len <= PFS_INLINE_SIZE){
+		if(!(*pagep = grab_cache_page_write_begin(mapping, 0, flags)))
+			return -ENOMEM;
+		if(!PageUptodate(*pagep))
+			pfs_inline_fill(mapping->host, *pagep);
+		return 0;
+	}
+	if(pfs_has_inline(mapping->host) && (ret = pfs_inline_convert(mapping->host)))
+		return ret;
+	if(!S_ISREG(mapping->host->i_mode))
+        	ret = block_write_begin(mapping, pos, len, flags, pagep, pfs_get_block);
+	else if(!(*pagep = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags)))
+		ret = -ENOMEM;
+	else{	/* block_write_begin(), with the delayed buffers unmapped on the way out */
+		ret = __block_write_begin(*pagep, pos, len, pfs_get_block_delay);
+		pfs_unmap_delayed(*pagep);
+		if(ret){
+			unlock_page(*pagep);
+			put_page(*pagep);
+			*pagep = NULL;
+		}
+	}
         if(unlikely(ret))
                 pfs_write_failed(mapping, pos + len);
         return ret;
 }
 
+static int
+pfs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied,
+		struct page *page, void *fsdata)
+{
+	char	*kaddr;
+	struct inode *inode = mapping->host;
+
+	if(!pfs_has_inline(inode))
+		return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+	kaddr = kmap_atomic(page);
+	memcpy((char *)PFS_I(inode)->i_addr + pos, kaddr + pos, copied);
+	kunmap_atomic(kaddr);
+	if(pos + copied > inode->i_size)
+		i_size_write(inode, pos + copied);
+	unlock_page(page);
+	put_page(page);
+	mark_inode_dirty(inode);
+	return copied;
+}
+
+/*
+ * pfs_get_block maps a whole run per call, so the direct I/O code builds
+ * one bio per contiguous range of the file
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+static ssize_t
+pfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+	loff_t	offset = iocb->ki_pos;
+	size_t	count = iov_iter_count(iter);
+	int	rw = iov_iter_rw(iter);
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	ssize_t	ret;
+
+	if(pfs_has_inline(mapping->host))	/* falls back to buffered I/O */
+		return 0;
+	ret = blockdev_direct_IO(iocb, mapping->host, iter, pfs_get_block);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static ssize_t
+pfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
+{
+	size_t	count = iov_iter_count(iter);
+	int	rw = iov_iter_rw(iter);
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	ssize_t	ret;
+
+	if(pfs_has_inline(mapping->host))	/* falls back to buffered I/O */
+		return 0;
+	ret = blockdev_direct_IO(iocb, mapping->host, iter, offset, pfs_get_block);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+static ssize_t
+pfs_direct_IO(int rw, struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
+{
+	size_t	count = iov_iter_count(iter);
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	ssize_t	ret;
+
+	if(pfs_has_inline(mapping->host))	/* falls back to buffered I/O */
+		return 0;
+	ret = blockdev_direct_IO(rw, iocb, mapping->host, iter, offset, pfs_get_block);
+#else
+static ssize_t
+pfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	size_t	count = iov_length(iov, nr_segs);
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	ssize_t	ret;
+
+	if(pfs_has_inline(mapping->host))	/* falls back to buffered I/O */
+		return 0;
+	ret = blockdev_direct_IO(rw, iocb, mapping->host, iov, offset, nr_segs, pfs_get_block);
+#endif
+	if(ret < 0 && (rw & WRITE))
+		pfs_write_failed(mapping, offset + count);
+	return ret;
+}
+
+/*
+ * delayed buffers dropped from the page give their reservation back
+ */
+static void
+pfs_invalidatepage(struct page *page, unsigned int offset, unsigned int length)
+{
+	int	n = 0;
+	unsigned int	start = 0;
+	struct buffer_head *bh, *head;
+
+	if(page_has_buffers(page)){
+		bh = head = page_buffers(page);
+		do{
+			if(buffer_delay(bh) && start >= offset && start + bh->b_size <= offset + length)
+				n++;
+			start += bh->b_size;
+		}while((bh = bh->b_this_page) != head);
+	}
+	if(n)
+		pfs_release_blocks(page->mapping->host, n);
+	block_invalidatepage(page, offset, length);
+}
+
 static sector_t
 pfs_block_bmap(struct address_space *mapping, sector_t block)
 {
+	if(pfs_has_inline(mapping->host))
+		return 0;
+	if(PFS_I(mapping->host)->i_reserved)
+		filemap_write_and_wait(mapping);
 	return generic_block_bmap(mapping, block, pfs_get_block);
 }
 
 const struct address_space_operations pfs_aops = {
         .readpage	= pfs_readpage,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+        .readahead	= pfs_readahead,
+#else
+        .readpages	= pfs_readpages,
+#endif
         .writepage 	= pfs_writepage,
+        .writepages	= pfs_writepages,
         .write_begin 	= pfs_write_begin, 
-        .write_end 	= generic_write_end,
+        .write_end 	= pfs_write_end,
         .bmap 		= pfs_block_bmap,
+        .invalidatepage	= pfs_invalidatepage,
+        .direct_IO	= pfs_direct_IO,
 };
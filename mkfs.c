@@ -52,6 +52,24 @@ pfs_bwrite(int fd, int64_t bno, const void *buf, int32_t cnt)
 	return 0;
 }
 
+/*
+ * the seed of the directory hash, so that names picked to collide on one
+ * filesystem don't on the next
+ */
+static uint32_t
+pfs_get_seed(void)
+{
+	int	fd;
+	uint32_t seed = 0;
+
+	if((fd = open("/dev/urandom", O_RDONLY)) >= 0){
+		if(read(fd, &seed, sizeof(seed)) != sizeof(seed))
+			seed = 0;
+		close(fd);
+	}
+	return seed ? seed : (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+}
+
 static int64_t
 pfs_get_size(int fd)
 {
@@ -136,7 +154,7 @@ creat_root(int fd, int64_t ino, int64_t dno)
         dbuf[1].d_len = 2; 
 	dbuf[0].d_next = dbuf[1].d_next = 0; 
 	dbuf[0].d_reclen = dbuf[1].d_reclen = (int16_t)htole16(sizeof(dbuf[0])); 
-        dbuf[0].d_ino = dbuf[1].d_ino = (int64_t)htole64(ino); 
+        dbuf[0].d_ino = dbuf[1].d_ino = (int64_t)htole64(ino | (int64_t)(S_IFDIR >> 12) << PFS_DE_TYPE_SHIFT); 
         memmove(dbuf[0].d_name, ".", 2);
         memmove(dbuf[1].d_name, "..", 3);
 	memset(buf, 0, PFS_BLOCKSIZ);
@@ -227,6 +245,8 @@ main(int argc, char *argv[])
 	spb.s_isize = (int64_t)htole64(PFS_INDS_PER_BLOCK); 
 	spb.s_bsize = (int64_t)htole64(PFS_STRS_PER_BLOCK);	
 	memmove(spb.s_magic, PFS_MAGIC_STRING, 4);
+	spb.s_feature = (int32_t)htole32(PFS_FEATURE_ALL & ~PFS_FEATURE_MOUNTED);
+	spb.s_hashseed = htole32(pfs_get_seed());
 	spb.s_iused = (int64_t)htole64(2);
 	spb.s_iroot = (int64_t)htole64(root); 
 	spb.s_icnt = (int64_t)htole64(PFS_INDS_PER_BLOCK - 2);     
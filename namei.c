@@ -31,6 +31,7 @@ pfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 
 	if(dentry->d_name.len > PFS_MAXNAMLEN)
 		return ERR_PTR(-ENAMETOOLONG);
+	pfs_dir_recount(dir);
 	inode = NULL;
 	if((ino = pfs_inode_by_name(dir, &dentry->d_name)) > 0){
 		inode = pfs_iget(dir->i_sb, ino);
@@ -140,9 +141,9 @@ static int
 pfs_unlink(struct inode *dir, struct dentry *dentry)
 {
 	int	err;
-	int64_t	dno;
-	struct buffer_head *bh;
+	struct buffer_head *bh, *ibh;
 	struct pfs_dir_entry *de;
+	struct pfs_dir_key key;
 	struct pfs_dir_hash_info hd, hd1;
 	const struct qstr *qstr = &dentry->d_name;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
@@ -150,13 +151,16 @@ pfs_unlink(struct inode *dir, struct dentry *dentry)
 #else
         struct inode *inode = dentry->d_inode;
 #endif
-	err = -ENOENT;
-	if(!(dno = pfs_get_block_number(dir, 0, 0))) 
-                return -EIO;
-        if(!(bh = sb_bread(dir->i_sb, dno / PFS_STRS_PER_BLOCK))) 
+	if(!(bh = pfs_dir_hblock(dir))) 
                 return -EIO;
-        pfs_add_hdentry(&hd, (int64_t *)((char *)bh->b_data + pfs_hash(qstr->name) * sizeof(int64_t)), 0, bh); 
-        if(!(de = pfs_find_entry(dir, qstr, pfs_match, &hd, &hd1))) 
+	pfs_dir_key(dir, qstr, &key);
+	if((err = pfs_dir_bucket(dir, bh, key.k_hash, &hd)) < 0){
+		brelse(bh);
+		return err;
+	}
+	err = -ENOENT;
+	ibh = hd.bh;
+        if(!(de = pfs_find_entry(dir, &key, pfs_match, &hd, &hd1))) 
 		goto out;
 	if((err = pfs_delete_entry(dir, de, bh, &hd, &hd1)))
 		goto out;
@@ -167,6 +171,7 @@ out:
                 brelse(hd.bh);
         if(hd1.bh)
                 brelse(hd1.bh);
+	brelse(ibh);
         brelse(bh);
         return err;
 }
@@ -224,14 +229,16 @@ static int
 pfs_rename(struct inode *old_dir, struct dentry *old_dentry,  struct inode *new_dir, struct dentry *new_dentry)
 {
 	int	err;
-	int64_t	dno;
 	const struct qstr *qstr;
 	struct buffer_head *old_bh; 
 	struct buffer_head *new_bh; 
 	struct buffer_head *dir_bh;
+	struct buffer_head *old_ibh;
+	struct buffer_head *new_ibh;
 	struct pfs_dir_entry *old_de;	
 	struct pfs_dir_entry *new_de;
 	struct pfs_dir_entry *dir_de = NULL;
+	struct pfs_dir_key key;
 	struct pfs_dir_hash_info old_hd, old_hd1;
 	struct pfs_dir_hash_info new_hd, new_hd1;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
@@ -246,21 +253,20 @@ pfs_rename(struct inode *old_dir, struct dentry *old_dentry,  struct inode *new_
 #endif
 	
 	err = -EIO;
-	dir_bh = old_bh = new_bh = old_hd.bh = old_hd1.bh = new_hd.bh = new_hd1.bh = NULL;
-        if(!(dno = pfs_get_block_number(old_dir, 0, 0))) 
+	dir_bh = old_bh = new_bh = old_ibh = new_ibh = old_hd.bh = old_hd1.bh = new_hd.bh = new_hd1.bh = NULL;
+        if(!(old_bh = pfs_dir_hblock(old_dir))) 
 		goto out;
-        if(!(old_bh = sb_bread(old_dir->i_sb, dno / PFS_STRS_PER_BLOCK))) 
+	qstr = &old_dentry->d_name;
+	pfs_dir_key(old_dir, qstr, &key);
+	if((err = pfs_dir_bucket(old_dir, old_bh, key.k_hash, &old_hd)) < 0)
 		goto out;
 	err = -ENOENT;
-	qstr = &old_dentry->d_name;
-        pfs_add_hdentry(&old_hd, (int64_t *)((char *)old_bh->b_data + pfs_hash(qstr->name) * sizeof(int64_t)), 0, old_bh);
-        if(!(old_de = pfs_find_entry(old_dir, qstr, pfs_match, &old_hd, &old_hd1))) 
+	old_ibh = old_hd.bh;
+        if(!(old_de = pfs_find_entry(old_dir, &key, pfs_match, &old_hd, &old_hd1))) 
                 goto out;
 	if(S_ISDIR(old_inode->i_mode)){
                 err = - EIO;
-                if(!(dno = pfs_get_block_number(old_inode, 0, 0)))
-                        goto out;
-                if(!(dir_bh = sb_bread(old_inode->i_sb, dno / PFS_STRS_PER_BLOCK)))
+                if(!(dir_bh = pfs_dir_hblock(old_inode)))
                         goto out;
                 dir_de = (struct pfs_dir_entry *)((char *)dir_bh->b_data +
                         PFS_DIRHASH_UNUSED * sizeof(int64_t) + sizeof(int64_t) + sizeof(*dir_de));
@@ -270,14 +276,15 @@ pfs_rename(struct inode *old_dir, struct dentry *old_dentry,  struct inode *new_
 		if(dir_de && !pfs_empty_dir(new_inode)) 
 			goto out;
 		err = -EIO;
-		if(!(dno = pfs_get_block_number(new_dir, 0, 0))) 
-                	goto out;
-        	if(!(new_bh = sb_bread(new_dir->i_sb, dno / PFS_STRS_PER_BLOCK))) 
+        	if(!(new_bh = pfs_dir_hblock(new_dir))) 
                 	goto out;
-		err = -ENOENT;
 		qstr = &new_dentry->d_name;
-		pfs_add_hdentry(&new_hd, (int64_t *)((char *)new_bh->b_data + pfs_hash(qstr->name) * sizeof(int64_t)), 0, new_bh);
-		if(!(new_de = pfs_find_entry(new_dir, qstr, pfs_match, &new_hd, &new_hd1)))
+		pfs_dir_key(new_dir, qstr, &key);
+		if((err = pfs_dir_bucket(new_dir, new_bh, key.k_hash, &new_hd)) < 0)
+			goto out;
+		err = -ENOENT;
+		new_ibh = new_hd.bh;
+		if(!(new_de = pfs_find_entry(new_dir, &key, pfs_match, &new_hd, &new_hd1)))
 			goto out;
 		new_de->d_ino = old_de->d_ino; 
 		new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME_SEC;
@@ -289,6 +296,21 @@ pfs_rename(struct inode *old_dir, struct dentry *old_dentry,  struct inode *new_
 	}else{
 		if((err = pfs_add_link(new_dentry, old_inode)))
 			goto out;
+		if(old_dir == new_dir){ 
+			/* the new name may have split the bucket of the old one */
+			brelse(old_hd.bh);
+			brelse(old_hd1.bh);
+			brelse(old_ibh);
+			old_hd.bh = old_hd1.bh = old_ibh = NULL;
+			qstr = &old_dentry->d_name;
+			pfs_dir_key(old_dir, qstr, &key);
+			if((err = pfs_dir_bucket(old_dir, old_bh, key.k_hash, &old_hd)) < 0)
+				goto out;
+			err = -ENOENT;
+			old_ibh = old_hd.bh;
+			if(!(old_de = pfs_find_entry(old_dir, &key, pfs_match, &old_hd, &old_hd1)))
+				goto out;
+		}
 		if(dir_de) 
 			inode_inc_link_count(new_dir);
 	}
@@ -298,7 +320,7 @@ pfs_rename(struct inode *old_dir, struct dentry *old_dentry,  struct inode *new_
 	mark_inode_dirty(old_inode);
 	if(dir_de){ 
 		if(old_dir != new_dir){ 
-			dir_de->d_ino = cpu_to_le64(PFS_I(new_dir)->i_ino); 
+			pfs_set_de_ino(old_inode->i_sb, dir_de, PFS_I(new_dir)->i_ino, S_IFDIR); 
 			mark_buffer_dirty_inode(dir_bh, old_inode);
 		}
 		inode_dec_link_count(old_dir); 
@@ -316,6 +338,10 @@ out:
 		brelse(old_bh);
 	if(new_bh)
 		brelse(new_bh);
+	if(old_ibh)
+		brelse(old_ibh);
+	if(new_ibh)
+		brelse(new_ibh);
 	if(dir_bh)
 		brelse(dir_bh);
 	return err;
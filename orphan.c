@@ -0,0 +1,207 @@
+#include	<linux/fs.h>
+#include	<linux/version.h>
+#include	<linux/sched.h>
+#include	<linux/workqueue.h>
+#include	<linux/writeback.h>
+#include	<linux/buffer_head.h>
+#include	"pfs.h"
+
+/*
+ * unlinked inodes of PFS_ORPHAN_BLOCKS blocks or more are not freed at
+ * evict. they are chained on disk from s_orphan through i_orphan and the
+ * worker of the mount frees their blocks PFS_ORPHAN_BATCH at a time, so
+ * statfs sees the space come back as it goes. what is left of the chain
+ * at umount is taken up again at the next read-write mount. while the
+ * chain isn't empty PFS_FEATURE_ORPHAN keeps drivers that don't know it
+ * from mounting and leaking its blocks
+ */
+
+/*
+ * called with s_olock held, after s_orphan changed
+ */
+static void
+pfs_orphan_feature(struct pfs_sb_info *sbi)
+{
+	int32_t	feature = le32_to_cpu(sbi->s_spb->s_feature) & ~PFS_FEATURE_ORPHAN;
+
+	if(sbi->s_spb->s_orphan)
+		feature |= PFS_FEATURE_ORPHAN;
+	sbi->s_spb->s_feature = cpu_to_le32(feature);
+	mark_buffer_dirty(sbi->s_sbh);
+}
+
+static struct pfs_inode *
+pfs_raw_inode(struct super_block *sb, int64_t ino, struct buffer_head **bhp)
+{
+	if(!(*bhp = sb_bread(sb, ino / PFS_INDS_PER_BLOCK))){
+		pr_warn("pfs: device %s: %s: failed to read inode %lld\n", sb->s_id, "pfs_raw_inode", ino);
+		return NULL;
+	}
+	return (struct pfs_inode *)(*bhp)->b_data + ino % PFS_INDS_PER_BLOCK;
+}
+
+/*
+ * the inode and its pointer blocks go to disk before the chain points
+ * at it
+ */
+int
+pfs_orphan_add(struct inode *inode)
+{
+	int	err;
+	struct pfs_inode *ip;
+	struct buffer_head *bh;
+	struct super_block *sb = inode->i_sb;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_ALL,
+	};
+
+	if(sb->s_flags & MS_RDONLY)
+		return -EROFS;
+	if((err = sync_mapping_buffers(inode->i_mapping)) || (err = pfs_write_inode(inode, &wbc)))
+		return err;
+	mutex_lock(&sbi->s_olock);
+	if(!(ip = pfs_raw_inode(sb, PFS_I(inode)->i_ino, &bh))){
+		err = -EIO;
+		goto out;
+	}
+	ip->i_orphan = sbi->s_spb->s_orphan;
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+	sbi->s_spb->s_orphan = cpu_to_le64(PFS_I(inode)->i_ino);
+	pfs_orphan_feature(sbi);
+	if(!sbi->s_ostop)
+		queue_work(system_long_wq, &sbi->s_owork);
+out:
+	mutex_unlock(&sbi->s_olock);
+	return err;
+}
+
+static int
+pfs_orphan_del(struct super_block *sb, int64_t ino)
+{
+	int	err = 0;
+	int64_t	next, cur;
+	struct pfs_inode *ip;
+	struct buffer_head *bh;
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	mutex_lock(&sbi->s_olock);
+	if(!(ip = pfs_raw_inode(sb, ino, &bh))){
+		err = -EIO;
+		goto out;
+	}
+	next = ip->i_orphan;
+	ip->i_orphan = 0;
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	if(le64_to_cpu(sbi->s_spb->s_orphan) == ino){
+		sbi->s_spb->s_orphan = next;
+		pfs_orphan_feature(sbi);
+		goto out;
+	}
+	for(cur = le64_to_cpu(sbi->s_spb->s_orphan); cur; brelse(bh)){
+		if(!(ip = pfs_raw_inode(sb, cur, &bh))){
+			err = -EIO;
+			goto out;
+		}
+		if(le64_to_cpu(ip->i_orphan) == ino){
+			ip->i_orphan = next;
+			mark_buffer_dirty(bh);
+			brelse(bh);
+			goto out;
+		}
+		cur = le64_to_cpu(ip->i_orphan);
+	}
+out:
+	mutex_unlock(&sbi->s_olock);
+	return err;
+}
+
+/*
+ * free the blocks from the end of the file down, writing the inode and
+ * its pointer blocks after each batch so that a crash never leaves the
+ * inode pointing at blocks already back on the free list
+ */
+static int
+pfs_orphan_reclaim(struct inode *inode)
+{
+	int	err;
+	sector_t block = (inode->i_size + PFS_BLOCKSIZ - 1) >> PFS_BLOCKSFT;
+	struct pfs_sb_info *sbi = PFS_SB(inode->i_sb);
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_ALL,
+	};
+
+	do{
+		if(ACCESS_ONCE(sbi->s_ostop))
+			return -EAGAIN;
+		block = block > PFS_ORPHAN_BATCH ? block - PFS_ORPHAN_BATCH : 0;
+		inode->i_size = (loff_t)block << PFS_BLOCKSFT;
+		pfs_truncate_blocks(inode);
+		if((err = sync_mapping_buffers(inode->i_mapping)) || (err = pfs_write_inode(inode, &wbc)))
+			return err;
+		cond_resched();
+	}while(block);
+	return 0;
+}
+
+void
+pfs_orphan_work(struct work_struct *work)
+{
+	int64_t	ino;
+	struct inode *inode;
+	struct pfs_sb_info *sbi = container_of(work, struct pfs_sb_info, s_owork);
+	struct super_block *sb = sbi->s_sb;
+
+	while(!ACCESS_ONCE(sbi->s_ostop) && (ino = le64_to_cpu(ACCESS_ONCE(sbi->s_spb->s_orphan)))){
+		inode = pfs_iget(sb, ino);
+		if(IS_ERR(inode)){
+			pr_warn("pfs: device %s: %s: failed to get orphan inode %lld\n", sb->s_id, "pfs_orphan_work", ino);
+			return;
+		}
+		if(inode->i_nlink){
+			pr_warn("pfs: device %s: %s: orphan inode %lld is still linked\n", sb->s_id, "pfs_orphan_work", ino);
+			pfs_orphan_del(sb, ino);
+			iput(inode);
+			continue;
+		}
+		PFS_I(inode)->i_orphan = 1;
+		if(pfs_orphan_reclaim(inode) || pfs_orphan_del(sb, ino)){
+			iput(inode);
+			return;
+		}
+		PFS_I(inode)->i_orphan = 0;
+		iput(inode);
+	}
+}
+
+void
+pfs_orphan_start(struct super_block *sb)
+{
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	mutex_lock(&sbi->s_olock);
+	sbi->s_ostop = 0;
+	/* a chain from before the feature bit is taken up and flagged */
+	if(!sbi->s_spb->s_orphan != !pfs_has_feature(sb, PFS_FEATURE_ORPHAN))
+		pfs_orphan_feature(sbi);
+	if(sbi->s_spb->s_orphan)
+		queue_work(system_long_wq, &sbi->s_owork);
+	mutex_unlock(&sbi->s_olock);
+}
+
+/*
+ * the inode being worked on stays on the chain with what is left of it
+ */
+void
+pfs_orphan_stop(struct super_block *sb)
+{
+	struct pfs_sb_info *sbi = PFS_SB(sb);
+
+	mutex_lock(&sbi->s_olock);
+	sbi->s_ostop = 1;
+	mutex_unlock(&sbi->s_olock);
+	cancel_work_sync(&sbi->s_owork);
+}
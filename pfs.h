@@ -6,23 +6,124 @@
 #define PFS_DEPTH	5	
 #define PFS_ALLOC_INODE	0	
 #define PFS_ALLOC_BLOCK	1	
+#define PFS_BCACHESIZ	16	
+#define PFS_BCACHEBATCH	8	
+#define PFS_ALLOCBATCH	64	
+#define PFS_PVECSIZ	16	
+#define PFS_FREEBATCH	512	
+#define PFS_MCACHESIZ	4	
+#define PFS_ORPHAN_BLOCKS	4096	
+#define PFS_ORPHAN_BATCH	32768	
+#define PFS_DIRIDX_MIN	64	/* blocks a directory needs before its buckets split */
+#define PFS_DIRCHAIN	16	
+#define PFS_DIRCACHE_MIN	8	/* blocks a directory needs before it is cached */
+#define PFS_DIRCACHE_BITS	14	
+#define PFS_DIRRA	16	/* directory blocks read ahead at a time */
 
+#define PFS_MAP_NEW	0x1	
+#define PFS_MAP_UNWRITTEN	0x2	
+#define PFS_DELAY_BLOCK	(~(sector_t)0)	/* b_blocknr of a delayed buffer during write_begin */
+
+#define PFS_CREATE	1	
+#define PFS_CREATE_UNWRITTEN	2	
+
+/*
+ * per-cpu stack of free blocks taken from the free list in batches. they
+ * are off the on-disk list until sync_fs or umount gives them back, so a
+ * crash loses up to PFS_BCACHESIZ blocks per cpu for good (there is no
+ * fsck), which is why the cache is kept small
+ */
+struct pfs_bcache{
+	spinlock_t	c_lock;
+	int	c_cnt;
+	int64_t	c_blk[PFS_BCACHESIZ];
+};
+
+struct pfs_stats{
+	unsigned long	st_mhit;
+	unsigned long	st_mmiss;
+	unsigned long	st_wbpages;	/* pages pfs_writepages wrote */
+	unsigned long	st_wbsingle;	/* pages pfs_writepage wrote alone */
+};
+
+#define pfs_stat_inc(sb, f)	this_cpu_inc(PFS_SB(sb)->s_stats->f)
+#define pfs_stat_add(sb, f, n)	this_cpu_add(PFS_SB(sb)->s_stats->f, n)
+
+/*
+ * s_ilock protects the inode free list (s_ihead, s_icnt, s_ifree, s_ibh,
+ * s_isize, s_iused), s_block protects the block free list (s_bhead, s_bcnt,
+ * s_bfree, s_bbh, s_bsize). s_ilock nests outside s_block. s_reserved
+ * counts the blocks promised to delayed writes but not yet allocated.
+ * s_olock protects the orphan chain (s_orphan) and s_ostop, s_owork
+ * frees the blocks of the inodes on it. s_dlock protects s_dlist, the
+ * directory caches of the mount, s_dnames counts what they hold.
+ */
 struct pfs_sb_info{
 	int64_t	*s_ifree; 	
 	int64_t	*s_bfree; 	
-	struct mutex s_lock;
+	struct mutex s_ilock;
+	struct mutex s_block;
+	struct mutex s_olock;
+	int	s_ostop;
+	struct work_struct	s_owork;
+	struct super_block	*s_sb;
+	spinlock_t	s_dlock;
+	struct list_head	s_dlist;
+	atomic_long_t	s_dnames;
+	struct pfs_bcache __percpu *s_bcache;
+	struct pfs_stats __percpu *s_stats;
+	atomic64_t	s_reserved;	
+	struct proc_dir_entry	*s_proc;
 	struct buffer_head	*s_sbh;
 	struct buffer_head	*s_ibh;
 	struct buffer_head	*s_bbh;
 	struct pfs_super_block	*s_spb; 
 };
 
+/*
+ * a recently mapped run of an inode, protected by i_lock
+ */
+struct pfs_mcache{
+	sector_t	c_lblk;
+	int64_t	c_pblk;
+	int	c_len;
+	int	c_flags;
+};
+
+struct pfs_dircache;
+
 struct pfs_inode_info{
 	int64_t	i_ino;
+	int64_t	i_goal;
+	int64_t	i_reserved;
+	struct task_struct	*i_wbtask;	/* running pfs_writepages for this inode */
+	struct writeback_control	*i_wbc;	/* its wbc, both under i_lock */
+	int32_t	i_esiz;
+	int	i_orphan;	/* on the orphan chain, evict leaves it to the worker */
+	int64_t	i_ext[PFS_NEXT];
 	int64_t	i_addr[PFS_NADDR];
+	int	i_mnext;
+	struct pfs_mcache i_mcache[PFS_MCACHESIZ];
+	struct rw_semaphore	i_mlock;	/* the block map: i_esiz, i_ext, i_addr and the blocks below */
+	struct rw_semaphore	i_dlock;	/* protects i_dcache, lookups share it */
+	struct pfs_dircache	*i_dcache;
+	int64_t	i_dents;	/* entries of a directory besides "." and "..", under i_dlock */
+	uint32_t	i_dgen;		/* s_crashes when i_dents was last known right */
+	struct buffer_head	*i_hbh;		/* hash block of a directory, pinned once read */
 	struct inode 	vfs_inode;
 };
 
+/*
+ * a run of m_len logical blocks starting at m_lblk, physically contiguous
+ * from sector m_pblk. a run is either wholly unwritten or not at all
+ */
+struct pfs_map{
+	sector_t	m_lblk;
+	int64_t	m_pblk;
+	int	m_len;
+	int	m_flags;
+};
+
 struct pfs_dir_hash_info{ 
 	int64_t	*p;	
 	int64_t	off;	
@@ -41,12 +142,70 @@ PFS_I(struct inode *inode)
 	return list_entry(inode, struct pfs_inode_info, vfs_inode);
 }
 
+static inline int64_t
+pfs_get_blocks(struct pfs_sb_info *sbi)
+{
+	return le64_to_cpu(sbi->s_spb->s_fsize) - le64_to_cpu(sbi->s_spb->s_isize) - sbi->s_sbh->b_blocknr * PFS_STRS_PER_BLOCK;
+}
+
+static inline int
+pfs_has_feature(struct super_block *sb, int32_t mask)
+{
+	return le32_to_cpu(PFS_SB(sb)->s_spb->s_feature) & mask;
+}
+
+static inline uint32_t
+pfs_crashes(struct super_block *sb)
+{
+	return le32_to_cpu(PFS_SB(sb)->s_spb->s_crashes);
+}
+
+static inline int
+pfs_has_extents(struct inode *inode)
+{
+	return PFS_I(inode)->i_esiz & PFS_EXT_FL;
+}
+
+static inline int
+pfs_has_inline(struct inode *inode)
+{
+	return PFS_I(inode)->i_esiz & PFS_INLINE_FL;
+}
+
+static inline void
+pfs_add_blocks(struct inode *inode, int64_t n)
+{
+	spin_lock(&inode->i_lock);
+	inode->i_blocks += n;
+	spin_unlock(&inode->i_lock);
+}
+
 static inline int64_t
 pfs_get_de_offset(struct pfs_dir_entry *de)
 {
 	return le64_to_cpu(de->d_next);
 }
 
+static inline int64_t
+pfs_get_de_ino(struct pfs_dir_entry *de)
+{
+	return le64_to_cpu(de->d_ino) & PFS_DE_INO_MASK;
+}
+
+static inline unsigned char
+pfs_get_de_type(struct pfs_dir_entry *de)
+{
+	return (uint64_t)le64_to_cpu(de->d_ino) >> PFS_DE_TYPE_SHIFT;
+}
+
+static inline void
+pfs_set_de_ino(struct super_block *sb, struct pfs_dir_entry *de, int64_t ino, umode_t mode)
+{
+	if(pfs_has_feature(sb, PFS_FEATURE_FTYPE))
+		ino |= (int64_t)((mode & S_IFMT) >> 12) << PFS_DE_TYPE_SHIFT;
+	de->d_ino = cpu_to_le64(ino);
+}
+
 static inline int16_t
 pfs_get_reclen(int8_t len)
 {
@@ -65,12 +224,73 @@ pfs_get_de_name(struct pfs_dir_entry *de)
 	return de->d_len < PFS_DIR_RECLEN ? de->d_name : (char *)de + sizeof(*de); 
 }
 
+static inline uint32_t
+pfs_dir_hash(struct super_block *sb, const char *name)
+{
+	if(pfs_has_feature(sb, PFS_FEATURE_DIRHASH))
+		return pfs_hash_seeded(name, le32_to_cpu(PFS_SB(sb)->s_spb->s_hashseed));
+	return pfs_hash_name(name);
+}
+
+static inline int
+pfs_has_de_hash(struct super_block *sb, struct pfs_dir_entry *de)
+{
+	return de->d_len >= PFS_DIR_RECLEN && pfs_has_feature(sb, PFS_FEATURE_DIRHASH);
+}
+
+static inline uint32_t
+pfs_get_de_hash(struct super_block *sb, struct pfs_dir_entry *de)
+{
+	uint32_t	h;
+
+	if(!pfs_has_de_hash(sb, de))
+		return pfs_dir_hash(sb, pfs_get_de_name(de));
+	memcpy(&h, de->d_name, sizeof(h));
+	return le32_to_cpu(h);
+}
+
+static inline void
+pfs_set_de_hash(struct super_block *sb, struct pfs_dir_entry *de, uint32_t hash)
+{
+	uint32_t	h = cpu_to_le32(hash);
+
+	if(pfs_has_de_hash(sb, de))
+		memcpy(de->d_name, &h, sizeof(h));
+}
+
+/*
+ * what pfs_match looks for. k_tag is set when long names carry their hash,
+ * the entries of other hashes are then passed over without a memcmp
+ */
+struct pfs_dir_key{
+	const struct qstr	*k_name;
+	uint32_t	k_hash;
+	int	k_tag;
+};
+
+static inline void
+pfs_dir_key(struct inode *dir, const struct qstr *qstr, struct pfs_dir_key *key)
+{
+	key->k_name = qstr;
+	key->k_hash = pfs_dir_hash(dir->i_sb, qstr->name);
+	key->k_tag = pfs_has_feature(dir->i_sb, PFS_FEATURE_DIRHASH);
+}
+
 static inline int
-pfs_match(const void *qstr, const void *de)
+pfs_match(const void *key, const void *de)
 {
-        if(((struct qstr *)qstr)->len != ((struct pfs_dir_entry *)de)->d_len) 
+	uint32_t	h;
+	const struct pfs_dir_key *k = key;
+	struct pfs_dir_entry *d = (struct pfs_dir_entry *)de;
+
+        if(k->k_name->len != d->d_len) 
                 return 0;
-        return !memcmp(((struct qstr *)qstr)->name, pfs_get_de_name((struct pfs_dir_entry *)de), ((struct qstr *)qstr)->len);
+	if(k->k_tag && d->d_len >= PFS_DIR_RECLEN){
+		memcpy(&h, d->d_name, sizeof(h));
+		if(le32_to_cpu(h) != k->k_hash)
+			return 0;
+	}
+        return !memcmp(k->k_name->name, pfs_get_de_name(d), k->k_name->len);
 }
 
 static inline int
@@ -91,15 +311,44 @@ extern int64_t	pfs_alloc_zero(struct super_block *sb);
 extern int64_t	pfs_alloc(struct super_block *sb, int type);
 extern int	pfs_free(struct super_block *sb, int64_t dno, int type);
 extern int	pfs_clear_block(struct super_block *sb, int64_t dno, int size);
+extern void	pfs_sort_blocklist(struct super_block *sb);
+extern int	pfs_alloc_blocks(struct super_block *sb, int64_t goal, int count, int64_t *dnos);
+extern int64_t	pfs_new_block(struct super_block *sb, int64_t goal);
+extern int	pfs_free_block(struct super_block *sb, int64_t dno);
+extern int	pfs_free_blocks(struct super_block *sb, int64_t *dnos, int count);
+extern int	pfs_init_bcache(struct super_block *sb);
+extern void	pfs_drain_bcache(struct super_block *sb);
+extern void	pfs_destroy_bcache(struct super_block *sb);
+extern int64_t	pfs_count_bcache(struct super_block *sb);
+extern int64_t	pfs_count_free(struct super_block *sb);
+extern int	pfs_reserve_blocks(struct inode *inode, int n);
+extern void	pfs_release_blocks(struct inode *inode, int64_t n);
 
 extern int	pfs_empty_dir(struct inode *dir);
+extern void	pfs_dir_recount(struct inode *dir);
 extern int	pfs_make_empty(struct inode *inode);
 extern int	pfs_add_link(struct dentry *dentry, struct inode *inode);
 extern int64_t	pfs_inode_by_name(struct inode *dir, const struct qstr *qstr);
 extern int	pfs_delete_entry(struct inode *dir, struct pfs_dir_entry *de, struct buffer_head *bh,
         		struct pfs_dir_hash_info *hdp, struct pfs_dir_hash_info *hdp1);
-extern struct pfs_dir_entry *pfs_find_entry(struct inode *dir, const struct qstr *qstr, int (*test)(const void *, const void *),
+extern struct pfs_dir_entry *pfs_dir_get(struct inode *dir, int64_t off, struct buffer_head **bhp);
+extern struct buffer_head *pfs_dir_hblock(struct inode *dir);
+extern void pfs_dir_release(struct inode *dir);
+extern void	pfs_dir_readahead(struct inode *dir, sector_t block, int count);
+extern int	pfs_dir_bucket(struct inode *dir, struct buffer_head *bh, uint32_t hash, struct pfs_dir_hash_info *hdp);
+extern struct pfs_dir_entry *pfs_find_entry(struct inode *dir, const void *key, int (*test)(const void *, const void *),
        	struct pfs_dir_hash_info *hdp, struct pfs_dir_hash_info *hdp1);
+extern struct pfs_dircache *pfs_dircache_get(struct inode *dir);
+extern int64_t	pfs_dircache_ino(struct inode *dir, const struct pfs_dir_key *key);
+extern struct pfs_dir_entry *pfs_dircache_slot(struct inode *dir, struct buffer_head *bh, const struct qstr *qstr,
+	struct pfs_dir_hash_info *hdp, struct pfs_dir_hash_info *hdp1);
+extern void	pfs_dircache_add(struct inode *dir, uint32_t hash, int64_t off);
+extern void	pfs_dircache_del(struct inode *dir, uint32_t hash, int64_t off);
+extern void	pfs_dircache_free(struct inode *dir, int64_t off, int len);
+extern void	pfs_dircache_merge(struct inode *dir, struct buffer_head *bh, int64_t off);
+extern void	pfs_dircache_drop(struct inode *dir);
+extern long	pfs_dircache_count(struct super_block *sb);
+extern long	pfs_dircache_scan(struct super_block *sb, long nr);
 
 extern void	pfs_evict_inode(struct inode *inode);
 extern void	pfs_truncate_blocks(struct inode *inode);
@@ -107,6 +356,21 @@ extern void	pfs_set_inode(struct inode *inode, dev_t rdev);
 extern int	pfs_free_inode(struct inode *inode);
 extern int	pfs_truncate(struct inode *inode, int64_t size);
 extern int	pfs_write_inode(struct inode *inode, struct writeback_control *wbc);
+extern void	pfs_mcache_clear(struct inode *inode);
+extern int	pfs_map_blocks(struct inode *inode, struct pfs_map *map, int create);
+extern int	__pfs_map_blocks(struct inode *inode, struct pfs_map *map, int create);
+extern int	pfs_map_lookup(struct inode *inode, struct pfs_map *map);
+extern int	pfs_set_blocks(struct inode *inode, sector_t block, int64_t dno, int count);
+extern void	pfs_truncate_bmap(struct inode *inode, sector_t block);
+extern int	pfs_ext_map_blocks(struct inode *inode, struct pfs_map *map, int create);
+extern void	pfs_ext_truncate(struct inode *inode, sector_t block);
+extern int	pfs_ext_punch(struct inode *inode, sector_t start, sector_t end);
+extern long	pfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+extern int	pfs_orphan_add(struct inode *inode);
+extern void	pfs_orphan_work(struct work_struct *work);
+extern void	pfs_orphan_start(struct super_block *sb);
+extern void	pfs_orphan_stop(struct super_block *sb);
+extern int	pfs_inline_convert(struct inode *inode);
 extern int64_t	pfs_get_block_number(struct inode *inode, sector_t block, int create);
 extern struct inode *pfs_iget(struct super_block *sb, int64_t ino);
 extern struct inode *pfs_new_inode(struct inode *dir, umode_t mode);
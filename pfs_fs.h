@@ -32,8 +32,24 @@
 #define PFS_MAGIC	0x50465331
 #define PFS_MAGIC_STRING	"PFS1" 
 
+#define PFS_FEATURE_EXTENT	0x1	
+#define PFS_FEATURE_INLINE	0x2	
+#define PFS_FEATURE_FTYPE	0x4	
+#define PFS_FEATURE_DIRHASH	0x8	
+#define PFS_FEATURE_DIRCOUNT	0x10	/* i_dents of directories is kept up to date */
+#define PFS_FEATURE_UNWRITTEN	0x20	/* PFS_UNWRITTEN and PFS_EXT_UNWRITTEN may be set */
+#define PFS_FEATURE_ORPHAN	0x40	/* set while the s_orphan chain isn't empty */
+#define PFS_FEATURE_DIRIDX	0x80	/* buckets may be split into index blocks */
+#define PFS_FEATURE_MOUNTED	0x100	/* set while mounted read-write, still set after a crash */
+#define PFS_FEATURE_ALL		(PFS_FEATURE_EXTENT | PFS_FEATURE_INLINE | PFS_FEATURE_FTYPE | PFS_FEATURE_DIRHASH | \
+				PFS_FEATURE_DIRCOUNT | PFS_FEATURE_UNWRITTEN | PFS_FEATURE_ORPHAN | PFS_FEATURE_DIRIDX | \
+				PFS_FEATURE_MOUNTED)
+
 #define PFS_DIRHASHSIZ	(((PFS_BLOCKSIZ - 2 * sizeof(struct pfs_dir_entry)) / 8) - 1)
 #define PFS_DIRHASH_UNUSED	PFS_DIRHASHSIZ
+#define PFS_DIRIDXSIZ	((PFS_BLOCKSIZ - sizeof(struct pfs_dir_entry)) / 8)
+#define PFS_DIRIDX_FL	0x4000000000000000LL	/* bucket head: offset of an index block */
+#define PFS_DIRLEVELS	3	
 
 #define PFS_MAXBLOCKS		0x100000000ULL		
 #define PFS_MAXFILESIZ		0x100000000000ULL 	
@@ -52,7 +68,11 @@ struct pfs_super_block{
 	int64_t	s_ihead;
 	int64_t	s_ilimit;	
 	char	s_magic[4];
-	char	s_depend[416];
+	int32_t	s_feature;
+	int64_t	s_orphan;	/* first unlinked inode whose blocks are still to be freed */
+	uint32_t	s_hashseed;	/* seed of the directory hash with PFS_FEATURE_DIRHASH */
+	uint32_t	s_crashes;	/* mounts that found PFS_FEATURE_MOUNTED set */
+	char	s_depend[396];
 };
 
 struct pfs_inode{	
@@ -69,9 +89,40 @@ struct pfs_inode{
 	int64_t	i_otime;
         int64_t	i_ext[PFS_NEXT];   	
         int64_t i_addr[PFS_NADDR]; 
-        char	i_pad[42];
+	int64_t	i_orphan;	/* next inode on the s_orphan chain */
+	int64_t	i_dents;	/* directory: entries besides "." and ".." */
+	uint32_t	i_dgen;		/* s_crashes when i_dents was last known right */
+        char	i_pad[22];
+};
+
+#define PFS_UNWRITTEN	0x1	/* data block pointer: allocated but never written */
+#define PFS_EXT_FL	0x80000000	
+#define PFS_INLINE_FL	0x40000000	/* i_esiz: the data of the file is in i_addr */
+#define PFS_INLINE_SIZE	(PFS_NADDR * sizeof(int64_t))
+#define PFS_EXT_UNWRITTEN	0x80000000	/* e_len: the extent is unwritten */
+#define PFS_EXT_MAXLEN	0x7FFFFFFF	
+#define PFS_IEXTS	(PFS_NADDR / 2)	
+#define PFS_EXTS_PER_BLOCK	(PFS_BLOCKSIZ / sizeof(struct pfs_extent))
+#define PFS_MAXEXTS	(PFS_IEXTS + PFS_EXT_BLOCK * PFS_EXTS_PER_BLOCK)
+
+/*
+ * i_esiz is the number of extents of the file or'ed with PFS_EXT_FL. the
+ * first PFS_IEXTS extents are held in i_addr, the others in the blocks
+ * i_ext[0] and i_ext[1], all of them sorted by e_lblk
+ */
+struct pfs_extent{
+	uint32_t	e_lblk;
+	uint32_t	e_len;
+	int64_t	e_pblk;
 };
 
+/*
+ * with PFS_FEATURE_FTYPE the top byte of d_ino holds the file type of the
+ * inode, (i_mode & S_IFMT) >> 12, which is its DT_ value
+ */
+#define PFS_DE_TYPE_SHIFT	56	
+#define PFS_DE_INO_MASK	((1LL << PFS_DE_TYPE_SHIFT) - 1)
+
 #define PFS_DIR_RECLEN     (sizeof(struct pfs_dir_entry) - (int)((struct pfs_dir_entry *)0)->d_name) 
 struct pfs_dir_entry{	
 	int64_t	d_ino; 	
@@ -81,8 +132,19 @@ struct pfs_dir_entry{
 	char	d_name[5];
 };
 
-static inline int
-pfs_hash(const char *str)
+/*
+ * a bucket of the hash block whose head has PFS_DIRIDX_FL set has been split
+ * into an index block: an unused record over the whole block, which readdir
+ * skips, followed by PFS_DIRIDXSIZ bucket heads. level 1 is the hash block,
+ * each level below hashes on the next bits of the name hash.
+ *
+ * the name hash is pfs_hash_name() on filesystems without
+ * PFS_FEATURE_DIRHASH. with it, it is pfs_hash_seeded() keyed by s_hashseed,
+ * and an entry whose name is stored after it keeps the hash, little endian,
+ * in the first 4 bytes of d_name
+ */
+static inline uint32_t
+pfs_hash_name(const char *str)
 {
 	uint32_t	hash;
 
@@ -90,7 +152,36 @@ pfs_hash(const char *str)
 		return 0;
 	for(hash = 0; *str; str++)
 		hash = *str + (hash << 6) + (hash << 16) - hash;
-	return hash % PFS_DIRHASHSIZ;
+	return hash;
+}
+
+/*
+ * fnv-1a finished with the murmur3 mix, so every bit of the result
+ * depends on every byte of the name
+ */
+static inline uint32_t
+pfs_hash_seeded(const char *str, uint32_t seed)
+{
+	uint32_t	hash;
+
+	for(hash = 2166136261U ^ seed; *str; str++)
+		hash = (hash ^ (unsigned char)*str) * 16777619U;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+static inline int
+pfs_hash_slot(uint32_t hash, int level)
+{
+	if(level == 1)
+		return hash % PFS_DIRHASHSIZ;
+	for(hash /= PFS_DIRHASHSIZ; level > 2; level--)
+		hash /= PFS_DIRIDXSIZ;
+	return hash % PFS_DIRIDXSIZ;
 }
 
 #endif
@@ -1,11 +1,17 @@
 #include	<linux/fs.h>
 #include	<linux/slab.h>
 #include	<linux/init.h>
+#include	<linux/blkdev.h>
 #include	<linux/mutex.h>
 #include	<linux/module.h>
 #include	<linux/printk.h>
+#include	<linux/percpu.h>
+#include	<linux/proc_fs.h>
+#include	<linux/seq_file.h>
+#include	<linux/version.h>
 #include	<linux/string.h>
 #include	<linux/statfs.h>
+#include	<linux/workqueue.h>
 #include	<linux/buffer_head.h>
 #include	"pfs.h"
 
@@ -14,16 +20,44 @@ MODULE_AUTHOR("颜文泽");
 MODULE_VERSION("1.0");
 
 static struct kmem_cache *pfs_inode_cachep;
+static struct proc_dir_entry *pfs_proc_root;
 
-static inline int64_t
-pfs_get_blocks(struct pfs_sb_info *sbi)
+/*
+ * PFS_FEATURE_MOUNTED is on the disk before anything else is written and
+ * cleared once everything else is
+ */
+static void
+pfs_set_mounted(struct super_block *s, int on)
 {
-	return le64_to_cpu(sbi->s_spb->s_fsize) - le64_to_cpu(sbi->s_spb->s_isize) - sbi->s_sbh->b_blocknr * PFS_STRS_PER_BLOCK;
+	int32_t	feature;
+	struct pfs_sb_info *sbi = PFS_SB(s);
+
+	if(!on)
+		sync_blockdev(s->s_bdev);
+	mutex_lock(&sbi->s_olock);
+	feature = le32_to_cpu(sbi->s_spb->s_feature) & ~PFS_FEATURE_MOUNTED;
+	sbi->s_spb->s_feature = cpu_to_le32(on ? feature | PFS_FEATURE_MOUNTED : feature);
+	mutex_unlock(&sbi->s_olock);
+	mark_buffer_dirty(sbi->s_sbh);
+	sync_dirty_buffer(sbi->s_sbh);
 }
 
+/*
+ * a read-write mount finding PFS_FEATURE_MOUNTED set follows a crash.
+ * s_crashes moves on, which makes every directory recount its entries
+ * at first use
+ */
 static int
 pfs_recovery(struct super_block *s)
 {
+	struct pfs_sb_info *sbi = PFS_SB(s);
+
+	if(pfs_has_feature(s, PFS_FEATURE_MOUNTED)){
+		pr_warn("pfs: device %s: %s: not unmounted cleanly, directory counts will be checked\n", 
+			s->s_id, "pfs_recovery");
+		sbi->s_spb->s_crashes = cpu_to_le32(pfs_crashes(s) + 1);
+	}
+	pfs_set_mounted(s, 1);
 	return 0;
 }
 
@@ -49,6 +83,8 @@ static void
 init_once(void *foo)
 {
 	struct pfs_inode_info *ei = (struct pfs_inode_info *)foo;
+	init_rwsem(&ei->i_dlock);
+	init_rwsem(&ei->i_mlock);
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -75,6 +111,11 @@ pfs_alloc_inode(struct super_block *sb)
 
         if(!(ei = (struct pfs_inode_info *)kmem_cache_alloc(pfs_inode_cachep, GFP_KERNEL)))
                 return NULL;
+	ei->i_orphan = 0;
+	ei->i_dcache = NULL;
+	ei->i_wbtask = NULL;
+	ei->i_wbc = NULL;
+	ei->i_hbh = NULL;
         return &ei->vfs_inode;
 }
 
@@ -84,60 +125,178 @@ pfs_destroy_inode(struct inode *inode)
 	call_rcu(&inode->i_rcu, pfs_i_callback);
 }
 
+static int
+pfs_stats_show(struct seq_file *m, void *v)
+{
+	int	cpu;
+	struct pfs_stats st, *p;
+	struct pfs_sb_info *sbi = PFS_SB(m->private);
+
+	memset(&st, 0, sizeof(st));
+	for_each_possible_cpu(cpu){
+		p = per_cpu_ptr(sbi->s_stats, cpu);
+		st.st_mhit += p->st_mhit;
+		st.st_mmiss += p->st_mmiss;
+		st.st_wbpages += p->st_wbpages;
+		st.st_wbsingle += p->st_wbsingle;
+	}
+	seq_printf(m, "map_cache_hit %lu\n", st.st_mhit);
+	seq_printf(m, "map_cache_miss %lu\n", st.st_mmiss);
+	seq_printf(m, "writeback_pages %lu\n", st.st_wbpages);
+	seq_printf(m, "writeback_single %lu\n", st.st_wbsingle);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+static int
+pfs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pfs_stats_show, PDE_DATA(inode));
+}
+
+static const struct file_operations pfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+/*
+ * /proc/fs/pfs/<device>/stats, a missing entry is not an error
+ */
+static void
+pfs_proc_init(struct super_block *s)
+{
+	struct pfs_sb_info *sbi = PFS_SB(s);
+
+	if(!pfs_proc_root || !(sbi->s_proc = proc_mkdir(s->s_id, pfs_proc_root)))
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+	proc_create_single_data("stats", 0444, sbi->s_proc, pfs_stats_show, s);
+#else
+	proc_create_data("stats", 0444, sbi->s_proc, &pfs_stats_fops, s);
+#endif
+}
+
+static void
+pfs_proc_exit(struct super_block *s)
+{
+	if(PFS_SB(s)->s_proc)
+		remove_proc_subtree(s->s_id, pfs_proc_root);
+}
+
 static void
 pfs_put_super(struct super_block *sb)
 {
 	struct pfs_sb_info	*sbi = PFS_SB(sb);
 	
+	pfs_proc_exit(sb);
+	free_percpu(sbi->s_stats);
+	pfs_destroy_bcache(sb);
+	if(!(sb->s_flags & MS_RDONLY))
+		pfs_set_mounted(sb, 0);
 	brelse(sbi->s_sbh);
 	brelse(sbi->s_ibh);
 	brelse(sbi->s_bbh);
-	mutex_destroy(&sbi->s_lock);
+	mutex_destroy(&sbi->s_ilock);
+	mutex_destroy(&sbi->s_block);
+	mutex_destroy(&sbi->s_olock);
 	kfree(sbi);
 	sb->s_fs_info = NULL;
 }
 
+/*
+ * the counters are read without the allocator locks, each one is a single
+ * aligned 64-bit word written under the lock of its own free list. blocks
+ * reserved for delayed writes are not free
+ */
 static int
 pfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
         struct super_block      *s = dentry->d_sb;
         struct pfs_sb_info      *sbi = PFS_SB(s);
 	u64	id = huge_encode_dev(s->s_bdev->bd_dev);
+	int64_t	bfree = pfs_count_free(s) - atomic64_read(&sbi->s_reserved);
+	int64_t	iused = le64_to_cpu(ACCESS_ONCE(sbi->s_spb->s_iused));
 
-	mutex_lock(&sbi->s_lock);
 	buf->f_type = s->s_magic;	
 	buf->f_bsize = s->s_blocksize; 	
 	buf->f_blocks = pfs_get_blocks(sbi) / PFS_STRS_PER_BLOCK; 
-	buf->f_bfree = buf->f_blocks - le64_to_cpu(sbi->s_spb->s_bsize) / PFS_STRS_PER_BLOCK; 
+	buf->f_bfree = bfree > 0 ? bfree : 0; 
 	buf->f_bavail = buf->f_bfree;	
 	buf->f_files = le64_to_cpu(sbi->s_spb->s_ilimit);	
-	buf->f_ffree = le64_to_cpu(sbi->s_spb->s_ilimit) - le64_to_cpu(sbi->s_spb->s_iused);	
+	buf->f_ffree = le64_to_cpu(sbi->s_spb->s_ilimit) - iused;	
 	buf->f_namelen = PFS_MAXNAMLEN; 
 	buf->f_fsid.val[0] = (u32)id;
 	buf->f_fsid.val[1] = (u32)(id >> 32);
-	mutex_unlock(&sbi->s_lock);
 	return 0;	
 }
 
 static int
-pfs_remount(struct super_block *s, int *flags, char *data)
+pfs_sync_fs(struct super_block *s, int wait)
 {
-	struct pfs_sb_info	*sbi = PFS_SB(s);
+	pfs_drain_bcache(s);
+	return 0;
+}
 
-	mutex_lock(&sbi->s_lock);
+static int
+pfs_remount(struct super_block *s, int *flags, char *data)
+{
+	if(!(s->s_flags & MS_RDONLY) && (*flags & MS_RDONLY))
+		pfs_orphan_stop(s);
 	sync_filesystem(s); 
-	mutex_unlock(&sbi->s_lock);
+	if(!(s->s_flags & MS_RDONLY) && (*flags & MS_RDONLY))
+		pfs_set_mounted(s, 0);
+	if((s->s_flags & MS_RDONLY) && !(*flags & MS_RDONLY)){
+		pfs_sort_blocklist(s);
+		pfs_recovery(s);
+		pfs_orphan_start(s);
+	}
 	return 0;
 }
 
+/*
+ * the directory caches are given back through the sb shrinker
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+static long
+pfs_nr_cached_objects(struct super_block *s, struct shrink_control *sc)
+{
+	return pfs_dircache_count(s);
+}
+
+static long
+pfs_free_cached_objects(struct super_block *s, struct shrink_control *sc)
+{
+	return pfs_dircache_scan(s, sc->nr_to_scan);
+}
+#else
+static long
+pfs_nr_cached_objects(struct super_block *s, int nid)
+{
+	return pfs_dircache_count(s);
+}
+
+static long
+pfs_free_cached_objects(struct super_block *s, long nr, int nid)
+{
+	return pfs_dircache_scan(s, nr);
+}
+#endif
+
 static const struct super_operations pfs_super_ops = {
 	.alloc_inode	= pfs_alloc_inode,
 	.destroy_inode	= pfs_destroy_inode,
 	.write_inode	= pfs_write_inode,
 	.evict_inode	= pfs_evict_inode,
 	.put_super	= pfs_put_super,
+	.sync_fs	= pfs_sync_fs,
 	.statfs		= pfs_statfs,
 	.remount_fs	= pfs_remount,
+	.nr_cached_objects	= pfs_nr_cached_objects,
+	.free_cached_objects	= pfs_free_cached_objects,
 };
 
 static int
@@ -153,7 +312,16 @@ pfs_fill_super(struct super_block *s, void *data, int silent)
 		pr_warn("pfs: device %s: %s: out of memory\n", s->s_id, "pfs_fill_super");	
 		return -ENOMEM;
 	}
-	mutex_init(&sbi->s_lock);	
+	mutex_init(&sbi->s_ilock);	
+	mutex_init(&sbi->s_block);	
+	mutex_init(&sbi->s_olock);	
+	atomic64_set(&sbi->s_reserved, 0);
+	sbi->s_ostop = 1;
+	sbi->s_sb = s;
+	spin_lock_init(&sbi->s_dlock);
+	INIT_LIST_HEAD(&sbi->s_dlist);
+	atomic_long_set(&sbi->s_dnames, 0);
+	INIT_WORK(&sbi->s_owork, pfs_orphan_work);
 	s->s_fs_info = sbi;
 	if(!sb_set_blocksize(s, PFS_BLOCKSIZ)){ 
 		pr_warn("pfs: device %s: %s: failed to set block size\n", s->s_id, "pfs_fill_super");
@@ -179,6 +347,12 @@ pfs_fill_super(struct super_block *s, void *data, int silent)
 			pr_warn("pfs: device %s: %s: unknown filesystem on device\n", s->s_id, "pfs_fill_super");
 		goto out1;
 	}
+	if(le32_to_cpu(sbi->s_spb->s_feature) & ~PFS_FEATURE_ALL){
+		if(!silent)
+			pr_warn("pfs: device %s: %s: unsupported features %x\n", s->s_id, "pfs_fill_super", 
+				le32_to_cpu(sbi->s_spb->s_feature) & ~PFS_FEATURE_ALL);
+		goto out1;
+	}
 	s->s_magic = PFS_MAGIC;
 	if(!(sbi->s_ibh = sb_bread(s, le64_to_cpu(sbi->s_spb->s_ihead) / PFS_INDS_PER_BLOCK))){
 		if(!silent) 
@@ -192,6 +366,12 @@ pfs_fill_super(struct super_block *s, void *data, int silent)
 		goto out2;
 	}
 	sbi->s_bfree = (int64_t *)sbi->s_bbh->b_data;
+	if((ret = pfs_init_bcache(s)) || !(sbi->s_stats = alloc_percpu(struct pfs_stats))){
+		pr_warn("pfs: device %s: %s: out of memory\n", s->s_id, "pfs_fill_super");	
+		ret = -ENOMEM;
+		goto out3;
+	}
+	ret = -EINVAL;
 	s->s_op = &pfs_super_ops;
 	rootp = pfs_iget(s, le64_to_cpu(sbi->s_spb->s_iroot));
 	if(IS_ERR(rootp)){
@@ -206,18 +386,29 @@ pfs_fill_super(struct super_block *s, void *data, int silent)
 			pr_warn("pfs: device %s: %s: failed to get root dentry: out of memory\n", s->s_id, "pfs_fill_super");
 		goto out3;
 	}
-	if((s->s_flags & MS_RDONLY) || !pfs_recovery(s)) 
+	pfs_proc_init(s);
+	if(s->s_flags & MS_RDONLY) 
+		return 0;
+	pfs_sort_blocklist(s);
+	if(!pfs_recovery(s)){
+		pfs_orphan_start(s);
 		return 0;
+	}
 	if(!silent)
 		pr_warn("pfs: device %s: %s: failed to recover filesystem\n", s->s_id, "pfs_fill_super");
 out3:
+	pfs_proc_exit(s);
+	free_percpu(sbi->s_stats);
+	pfs_destroy_bcache(s);
 	brelse(sbi->s_bbh);
 out2:
 	brelse(sbi->s_ibh);
 out1:
 	brelse(bh);
 out:
-	mutex_destroy(&sbi->s_lock);	
+	mutex_destroy(&sbi->s_ilock);	
+	mutex_destroy(&sbi->s_block);	
+	mutex_destroy(&sbi->s_olock);	
 	kfree(sbi);
 	s->s_fs_info = NULL;
 	return ret;
@@ -229,12 +420,22 @@ pfs_mount(struct file_system_type *fs_type, int flags, const char *dev_name, voi
         return mount_bdev(fs_type, flags, dev_name, data, pfs_fill_super); 
 }
 
+/*
+ * the orphan worker holds inodes, it has to be gone before they are evicted
+ */
+static void
+pfs_kill_sb(struct super_block *sb)
+{
+	if(sb->s_fs_info)
+		pfs_orphan_stop(sb);
+	kill_block_super(sb);
+}
 
 static struct file_system_type pfs_fs_type = {
 	.owner 		= THIS_MODULE,
 	.name 		= "pfs",
 	.mount 		= pfs_mount,
-	.kill_sb 	= kill_block_super,
+	.kill_sb 	= pfs_kill_sb,
 	.fs_flags 	= FS_REQUIRES_DEV,
 };
 
@@ -245,8 +446,12 @@ init_pfs_fs(void)
 
 	if((err = init_inodecache()))
 		return err;
-	if((err = register_filesystem(&pfs_fs_type))) 
+	pfs_proc_root = proc_mkdir("fs/pfs", NULL);
+	if((err = register_filesystem(&pfs_fs_type))){ 
+		if(pfs_proc_root)
+			remove_proc_entry("fs/pfs", NULL);
 		destroy_inodecache(); 
+	}
 	return err;
 }
 
@@ -254,6 +459,8 @@ static void __exit
 exit_pfs_fs(void)
 {
 	unregister_filesystem(&pfs_fs_type); 
+	if(pfs_proc_root)
+		remove_proc_entry("fs/pfs", NULL);
 	destroy_inodecache();
 }
 